@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <sys/stat.h>
 #include <dirent.h>
@@ -8,304 +9,5646 @@
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+#if __has_include(<linux/openat2.h>)
+#define HAVE_OPENAT2 1
+#include <linux/openat2.h>
+#endif
+#endif
 
 #define NO_ERROR 0
 #define ERROR -1
+#define NOT_SUPPORTED -2
+#define HANDED_OFF 1
 #define BUF_SIZE 4096
-#define RETRY_SECONDS 5
+#define ADAPTIVE_BUF_MAX (1L << 20)
+#define DIRECT_ALIGNMENT 4096
+#define DIRECT_BUF_SIZE (4L << 20)
+#define DIRECT_THRESHOLD (8L << 20)
+#define FD_RESERVE 16
+#define FD_WAIT_MILLISECONDS 100
+#define DIR_ENTRIES_INITIAL_CAPACITY 4096
+#define GETDENTS_BUF_SIZE (64 * 1024)
+#define HASH_BUF_SIZE (64 * 1024)
+#define HASH_PRIME 0x9E3779B97F4A7C15ULL
+#define CRC32C_POLY 0x82F63B78U
+#define MANIFEST_INITIAL_CAPACITY 1024
+#define MANIFEST_LINE_MAX (PATH_MAX * 2 + 64)
+#define TEMP_SUFFIX_MAX 48
+#define ARENA_CHUNK_SIZE 16384
+#define SIDE_SRC 0
+#define SIDE_DEST 1
+#define DEQUE_INITIAL_CAPACITY 64
+#define MAX_CHUNK_SIZE (1L << 30)
+#define PIPE_CHUNK_SIZE (1L << 16)
+#define DEFAULT_CHUNK_THRESHOLD (128L << 20)
+#define DEFAULT_CHUNK_SIZE (16L << 20)
+#define URING_ENTRIES 64
+#define URING_SLOTS 16
+#define URING_BUFFER_SIZE (128 * 1024)
+#define PIPELINE_BUFFER_SIZE (1L << 20)
+#define PIPELINE_BUFFER_ALIGNMENT 4096
+#define PIPELINE_BUFFERS_PER_THREAD 4
+#define SCHEDULE_FILE_COST (64L << 10)
+#define SCHEDULE_BATCH_COST (16L << 20)
+#define SCHEDULE_BATCH_FILES 256
+#define SCHEDULE_TASKS_PER_WORKER 4
+#define SCHEDULE_INITIAL_CAPACITY 1024
+#define TAR_BLOCK_SIZE 512
+#define TAR_PAX_NAME "PaxHeaders/"
+#define ARCHIVE_INLINE_MAX (1L << 20)
+#define ARCHIVE_QUEUE_MAX (64L << 20)
+#define ARCHIVE_BUFFER_SIZE (1L << 20)
+#define UNPACK_DIRS_INITIAL_CAPACITY 256
+#define UNPACK_IN_FLIGHT_BUCKETS 4096
+#define INODE_MAP_SHARDS 64
+#define INODE_MAP_INITIAL_BUCKETS 64
+#define SIZE_BUCKETS 6
+#define LATENCY_BUCKETS 24
+#define USEC_PER_SEC 1000000LL
+#define BYTES_PER_MB (1024.0 * 1024.0)
 
 #define STRINGS_EQUAL(STR1, STR2) (strcmp(STR1, STR2) == 0)
-#define IS_STRING_EMPTY(STR) ((STR) == NULL || (STR)[0] == '\0')
+#define ALIGN_UP(VALUE, ALIGNMENT) (((VALUE) + (ALIGNMENT) - 1) & ~((size_t)(ALIGNMENT) - 1))
+
+typedef struct dir_node {
+    struct dir_node *parent;
+    atomic_long refs;
+    int fds[2];
+    int retained;
+    const char *name;
+    size_t name_length;
+    char *entries;
+    struct stat stat_buf;
+} dir_node_t;
+
+typedef struct entry {
+    dir_node_t *parent;
+    unsigned int name_length;
+    unsigned char type;
+    char name[];
+} entry_t;
+
+typedef struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linux_dirent64_t;
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_chunk_t;
+
+typedef enum copy_strategy {
+    STRATEGY_COPY_FILE_RANGE,
+    STRATEGY_SENDFILE,
+    STRATEGY_SPLICE,
+    STRATEGY_READ_WRITE,
+    STRATEGY_COUNT
+} copy_strategy_t;
+
+const char *strategy_names[STRATEGY_COUNT] = { "copy_file_range", "sendfile", "splice", "read_write" };
+
+typedef enum reflink_mode {
+    REFLINK_AUTO,
+    REFLINK_ALWAYS,
+    REFLINK_NEVER
+} reflink_mode_t;
+
+typedef struct chunk_job {
+    entry_t *entry;
+    char *temp_name;
+    struct stat stat_buf;
+    off_t size;
+    off_t chunk_size;
+    int sparse;
+    mode_t dest_mode;
+    atomic_llong skipped;
+    atomic_long next_chunk;
+    atomic_long remaining;
+    atomic_int failed;
+    atomic_int used;
+    long long started;
+    uint32_t *crcs;
+} chunk_job_t;
+
+typedef struct pipeline_job {
+    struct pipeline_job *next;
+    entry_t *entry;
+    char *temp_name;
+    struct stat stat_buf;
+    int src_fd;
+    int dest_fd;
+    off_t size;
+    off_t next_offset;
+    long remaining;
+    int failed;
+    long long started;
+    uint32_t *crcs;
+} pipeline_job_t;
+
+typedef struct pipeline_block {
+    pipeline_job_t *job;
+    char *buffer;
+    off_t offset;
+    ssize_t length;
+} pipeline_block_t;
+
+typedef struct pipeline {
+    pthread_mutex_t mutex;
+    pthread_cond_t read_cond;
+    pthread_cond_t write_cond;
+    pthread_t *threads;
+    long started;
+    long readers;
+    long writers;
+    char *memory;
+    char **free_buffers;
+    long free_count;
+    pipeline_block_t *filled;
+    long filled_head;
+    long filled_count;
+    long buffer_count;
+    pipeline_job_t *jobs_head;
+    pipeline_job_t *jobs_tail;
+    int shutdown;
+} pipeline_t;
+
+typedef struct manifest_record {
+    char *path;
+    const char *target;
+    off_t size;
+    uint32_t crc;
+} manifest_record_t;
+
+typedef struct manifest {
+    pthread_mutex_t mutex;
+    manifest_record_t *records;
+    size_t count;
+    size_t capacity;
+} manifest_t;
+
+typedef struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+} tar_header_t;
+
+typedef struct pax_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+} pax_buffer_t;
+
+typedef struct archive_record {
+    struct archive_record *next;
+    entry_t *entry;
+    char *data;
+    size_t length;
+    int src_fd;
+    off_t size;
+    long long started;
+} archive_record_t;
+
+typedef struct archive {
+    pthread_mutex_t mutex;
+    pthread_cond_t write_cond;
+    pthread_cond_t space_cond;
+    pthread_t thread;
+    int fd;
+    int root_fd;
+    int running;
+    int shutdown;
+    int error;
+    size_t queued;
+    archive_record_t *head;
+    archive_record_t *tail;
+    struct unpack_file *in_flight[UNPACK_IN_FLIGHT_BUCKETS];
+} archive_t;
+
+typedef struct tar_entry {
+    char *path;
+    char *target;
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    dev_t rdev;
+    struct timespec times[2];
+    char *pax;
+    size_t pax_length;
+} tar_entry_t;
+
+typedef struct archive_reader {
+    int fd;
+    char *buffer;
+    size_t start;
+    size_t end;
+} archive_reader_t;
+
+typedef struct unpack_file {
+    struct unpack_file *next;
+    tar_entry_t entry;
+    char *data;
+    long long started;
+} unpack_file_t;
+
+typedef struct unpack_dirs {
+    tar_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} unpack_dirs_t;
+
+typedef struct scheduled_file {
+    entry_t *entry;
+    off_t cost;
+} scheduled_file_t;
+
+typedef struct schedule {
+    pthread_mutex_t mutex;
+    scheduled_file_t *files;
+    size_t count;
+    size_t capacity;
+} schedule_t;
+
+typedef struct file_batch {
+    size_t count;
+    entry_t *entries[];
+} file_batch_t;
+
+typedef struct inode_waiter {
+    struct inode_waiter *next;
+    entry_t *entry;
+} inode_waiter_t;
+
+typedef struct inode_link {
+    struct inode_link *next;
+    dev_t dev;
+    ino_t ino;
+    const entry_t *owner;
+    inode_waiter_t *waiters;
+    char path[];
+} inode_link_t;
+
+typedef struct inode_shard {
+    pthread_mutex_t mutex;
+    inode_link_t **buckets;
+    size_t bucket_count;
+    size_t size;
+} inode_shard_t;
 
-typedef struct paths {
-    char *src;
-    char *dest;
-} paths_t;
+typedef struct copy_stats {
+    atomic_llong files;
+    atomic_llong links;
+    atomic_llong directories;
+    atomic_llong bytes;
+    atomic_llong syscalls;
+    atomic_llong retries;
+    atomic_llong fd_waits;
+    atomic_llong errors;
+    atomic_llong latency[SIZE_BUCKETS][LATENCY_BUCKETS];
+} copy_stats_t;
 
-void *copy_path(void *param);
+typedef struct stats_totals {
+    long long files;
+    long long links;
+    long long directories;
+    long long bytes;
+    long long syscalls;
+    long long retries;
+    long long fd_waits;
+    long long errors;
+} stats_totals_t;
+
+typedef struct progress {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int done;
+} progress_t;
+
+typedef struct xattr_target {
+    int fd;
+    const char *path;
+} xattr_target_t;
+
+typedef int (*xattr_visit_t)(void *context, const char *name, const char *value, size_t size);
+
+typedef void (*task_func_t)(void *arg);
+
+typedef struct task {
+    task_func_t func;
+    void *arg;
+} task_t;
+
+typedef struct deque {
+    pthread_mutex_t mutex;
+    task_t *tasks;
+    size_t capacity;
+    size_t head;
+    size_t size;
+} deque_t;
+
+struct thread_pool;
+struct uring;
+
+typedef struct worker {
+    struct thread_pool *pool;
+    pthread_t thread;
+    long id;
+    unsigned int seed;
+    deque_t deque;
+    int pipe_fds[2];
+    struct uring *ring;
+    copy_stats_t stats;
+} worker_t;
+
+typedef struct thread_pool {
+    worker_t *workers;
+    long size;
+    long started;
+    deque_t injector;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    atomic_long queued;
+    atomic_long pending;
+    atomic_long idle;
+    int shutdown;
+} thread_pool_t;
+
+typedef struct fd_gate {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    long available;
+    long limit;
+    long dir_retained;
+    long dir_limit;
+    unsigned long generation;
+} fd_gate_t;
+
+typedef struct options {
+    long threads;
+    copy_strategy_t strategy;
+    int verbose;
+    int direct;
+    int schedule;
+    int uring;
+    off_t chunk_threshold;
+    off_t chunk_size;
+    int sync;
+    int hash;
+    int metadata;
+    reflink_mode_t reflink;
+    long progress_interval;
+    long readers;
+    long writers;
+    const char *summary_path;
+    const char *manifest_path;
+    const char *verify_path;
+    const char *archive_path;
+    const char *extract_path;
+} options_t;
+
+options_t options;
+thread_pool_t copy_pool;
+pipeline_t pipeline;
+fd_gate_t fd_gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0 };
+const char *root_paths[2];
+size_t root_lengths[2];
+atomic_int strategy_disabled[STRATEGY_COUNT];
+atomic_int uring_unavailable;
+atomic_ulong temp_counter;
+atomic_llong sparse_bytes_skipped;
+atomic_int reflink_refused;
+copy_stats_t shared_stats;
+inode_shard_t inode_map[INODE_MAP_SHARDS];
+schedule_t schedule = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+manifest_t manifest = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+atomic_long verify_failures;
+archive_t archive = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, -1, -1, 0, 0, 0, 0, NULL, NULL, { NULL } };
+uint32_t crc32c_table[256];
+uint32_t crc32c_x2n_table[32];
+uint32_t (*crc32c_update)(uint32_t crc, const char *buf, size_t length);
+progress_t progress = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+const off_t size_bucket_limits[SIZE_BUCKETS] = { 4L << 10, 64L << 10, 1L << 20, 16L << 20, 256L << 20, -1 };
+__thread worker_t *current_worker = NULL;
+__thread arena_chunk_t *path_arena = NULL;
+__thread char *dirent_buffer = NULL;
+__thread char *copy_buffer = NULL;
+__thread size_t copy_buffer_size = 0;
+__thread char *direct_buffer = NULL;
+
+#define STATS_ADD(FIELD, VALUE) atomic_fetch_add_explicit(&local_stats()->FIELD, (VALUE), memory_order_relaxed)
+
+void copy_path(void *param);
+int archive_add_directory(const entry_t *entry, const struct stat *stat_buf, int src_fd);
+void copy_file_blocking(void *param);
+void inode_map_settle(const entry_t *entry, const struct stat *stat_buf, int result);
+void uring_destroy(struct uring *ring);
+void uring_drain(struct uring *ring);
+void uring_wait(struct uring *ring);
+int uring_is_busy(struct uring *ring);
+int clone_file(int src_fd, int dest_fd, const entry_t *entry);
 
 void print_error(const char *prefix, int code) {
     char buf[256];
-    if (NO_ERROR != strerror_r(code, buf, sizeof(buf))) {
-        strcpy(buf, "(unable to generate error!)");
+    fprintf(stderr, "%s: %s\n", prefix, strerror_r(code, buf, sizeof(buf)));
+}
+
+copy_stats_t *local_stats(void) {
+    return NULL != current_worker ? &current_worker->stats : &shared_stats;
+}
+
+long long now_usec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * USEC_PER_SEC + now.tv_nsec / 1000;
+}
+
+int size_bucket(off_t size) {
+    int bucket = 0;
+    while (bucket < SIZE_BUCKETS - 1 && size >= size_bucket_limits[bucket]) {
+        bucket++;
     }
-    fprintf(stderr, "%s: %s\n", prefix, buf);
+    return bucket;
 }
 
-int open_file_with_retry(char *path, int oflag, mode_t mode) {
-    errno = 0;
-    while (1) {
-        int fd = open(path, oflag, mode);
-        if (ERROR != fd) {
-            return fd;
-        }
-        if (EMFILE != errno) {
-            perror(path);
-            break;
-        }
-        sleep(RETRY_SECONDS);
+void stats_file_done(long long started, off_t size, int result) {
+    long long elapsed = now_usec() - started;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && elapsed >= (1LL << bucket)) {
+        bucket++;
+    }
+    STATS_ADD(latency[size_bucket(size)][bucket], 1);
+    if (ERROR == result) {
+        STATS_ADD(errors, 1);
+    }
+    else {
+        STATS_ADD(files, 1);
     }
-    return ERROR;
 }
 
-DIR *open_dir_with_retry(char *path) {
-    errno = 0;
-    while (1) {
-        DIR *dir = opendir(path);
-        if (NULL != dir) {
-            return dir;
-        }
-        if (EMFILE != errno) {
-            perror(path);
-            break;
+void stats_read(const copy_stats_t *stats, stats_totals_t *totals) {
+    totals->files += atomic_load_explicit(&stats->files, memory_order_relaxed);
+    totals->links += atomic_load_explicit(&stats->links, memory_order_relaxed);
+    totals->directories += atomic_load_explicit(&stats->directories, memory_order_relaxed);
+    totals->bytes += atomic_load_explicit(&stats->bytes, memory_order_relaxed);
+    totals->syscalls += atomic_load_explicit(&stats->syscalls, memory_order_relaxed);
+    totals->retries += atomic_load_explicit(&stats->retries, memory_order_relaxed);
+    totals->fd_waits += atomic_load_explicit(&stats->fd_waits, memory_order_relaxed);
+    totals->errors += atomic_load_explicit(&stats->errors, memory_order_relaxed);
+}
+
+void stats_collect(stats_totals_t *totals) {
+    memset(totals, 0, sizeof(stats_totals_t));
+    stats_read(&shared_stats, totals);
+    for (long i = 0; i < copy_pool.size; i++) {
+        stats_read(&copy_pool.workers[i].stats, totals);
+    }
+}
+
+uint32_t crc32c_update_table(uint32_t crc, const char *buf, size_t length) {
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = crc32c_table[(crc ^ (unsigned char)buf[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_update_sse42(uint32_t crc, const char *buf, size_t length) {
+    uint64_t value = ~crc;
+    while (length > 0 && 0 != ((uintptr_t)buf & 7)) {
+        value = _mm_crc32_u8((uint32_t)value, (unsigned char)*buf++);
+        length--;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        value = _mm_crc32_u64(value, word);
+        buf += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        value = _mm_crc32_u8((uint32_t)value, (unsigned char)*buf++);
+        length--;
+    }
+    return ~(uint32_t)value;
+}
+#endif
+
+uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
+    uint32_t mask = 1U << 31;
+    uint32_t product = 0;
+    while (0 != mask) {
+        if (a & mask) {
+            product ^= b;
         }
-        sleep(RETRY_SECONDS);
+        mask >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
     }
-    return NULL;
+    return product;
 }
 
-int create_thread_with_retry(void *param) {
-    int errorCode;
-    pthread_t thread;
-    while (1) {
-        errorCode = pthread_create(&thread, NULL, copy_path, param);
-        if (NO_ERROR == errorCode) {
-            pthread_detach(thread);
-            break;
+uint32_t crc32c_shift(uint32_t crc, off_t length) {
+    uint32_t power = 1U << 31;
+    for (int k = 3; length > 0; length >>= 1, k++) {
+        if (length & 1) {
+            power = crc32c_multiply(crc32c_x2n_table[k & 31], power);
         }
-        if (EAGAIN != errorCode) {
-            print_error("Unable to create thread", errorCode);
-            break;
+    }
+    return crc32c_multiply(power, crc);
+}
+
+uint32_t crc32c_combine(uint32_t first, uint32_t second, off_t second_length) {
+    return crc32c_shift(first, second_length) ^ second;
+}
+
+uint32_t crc32c_zeros(uint32_t crc, off_t length) {
+    return crc32c_shift(crc, length) ^ ~crc32c_shift(0xFFFFFFFFU, length);
+}
+
+void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
         }
-        sleep(RETRY_SECONDS);
+        crc32c_table[i] = crc;
+    }
+    crc32c_x2n_table[0] = 1U << 30;
+    for (int i = 1; i < 32; i++) {
+        crc32c_x2n_table[i] = crc32c_multiply(crc32c_x2n_table[i - 1], crc32c_x2n_table[i - 1]);
+    }
+
+    crc32c_update = crc32c_update_table;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_update_sse42;
     }
-    return errorCode;
+#endif
 }
 
-char *concat_strings(const char **strings) {
-    if (NULL == strings) {
-        fprintf(stderr, "concat_strings: invalid strings\n");
-        return NULL;
+int fd_gate_init(long reserved) {
+    struct rlimit limit;
+    if (ERROR == getrlimit(RLIMIT_NOFILE, &limit)) {
+        perror("getrlimit");
+        return ERROR;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        rlim_t soft = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        if (ERROR == setrlimit(RLIMIT_NOFILE, &limit)) {
+            limit.rlim_cur = soft;
+        }
     }
 
-    size_t total_length = 0;
-    for (int i = 0; strings[i] != NULL; i++) {
-        total_length += strlen(strings[i]);
+    long available = (RLIM_INFINITY == limit.rlim_cur || limit.rlim_cur > LONG_MAX) ? LONG_MAX : (long)limit.rlim_cur;
+    available -= reserved;
+    if (available < 2) {
+        fprintf(stderr, "Not enough file descriptors: limit %ld, %ld reserved\n", available + reserved, reserved);
+        return ERROR;
     }
+    fd_gate.available = available;
+    fd_gate.limit = available;
+    fd_gate.dir_limit = available / 2;
+    return NO_ERROR;
+}
 
-    char *str = calloc(1, (total_length + 1) * sizeof(char));
+int fd_try_acquire(long count) {
+    int result = ERROR;
+    pthread_mutex_lock(&fd_gate.mutex);
+    if (fd_gate.available >= count) {
+        fd_gate.available -= count;
+        result = NO_ERROR;
+    }
+    pthread_mutex_unlock(&fd_gate.mutex);
+    return result;
+}
 
-    if (NULL != str) {
-        for (int i = 0; strings[i] != NULL; i++) {
-            strcat(str, strings[i]);
+void fd_acquire(long count) {
+    // Descriptors held by this worker's ring are only released by reaping
+    // it, so a worker never sleeps on the budget while its ring is busy
+    struct uring *ring = NULL == current_worker ? NULL : current_worker->ring;
+    while (uring_is_busy(ring)) {
+        if (NO_ERROR == fd_try_acquire(count)) {
+            return;
         }
+        uring_wait(ring);
     }
 
-    return str;
+    pthread_mutex_lock(&fd_gate.mutex);
+    if (fd_gate.available < count) {
+        STATS_ADD(fd_waits, 1);
+    }
+    while (fd_gate.available < count) {
+        pthread_cond_wait(&fd_gate.cond, &fd_gate.mutex);
+    }
+    fd_gate.available -= count;
+    pthread_mutex_unlock(&fd_gate.mutex);
 }
 
-void free_paths(paths_t *paths) {
-    if (NULL == paths) {
-        return;
+void fd_release(long count) {
+    pthread_mutex_lock(&fd_gate.mutex);
+    fd_gate.available += count;
+    fd_gate.generation++;
+    pthread_cond_broadcast(&fd_gate.cond);
+    pthread_mutex_unlock(&fd_gate.mutex);
+}
+
+void fd_wait_for_release(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += FD_WAIT_MILLISECONDS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
     }
 
-    free(paths->src);
-    free(paths->dest);
-    free(paths);
+    pthread_mutex_lock(&fd_gate.mutex);
+    unsigned long generation = fd_gate.generation;
+    while (generation == fd_gate.generation) {
+        if (ETIMEDOUT == pthread_cond_timedwait(&fd_gate.cond, &fd_gate.mutex, &deadline)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fd_gate.mutex);
 }
 
-paths_t *build_paths(const char *src_path, const char *dest_path, const char *sub_path) {
-    if (NULL == src_path || NULL == dest_path) {
-        fprintf(stderr, "build_paths: invalid src_path and/or dest_path\n");
-        return NULL;
+int fd_try_retain_dir(void) {
+    int result = ERROR;
+    pthread_mutex_lock(&fd_gate.mutex);
+    if (fd_gate.dir_retained + 2 <= fd_gate.dir_limit && fd_gate.available >= 1) {
+        fd_gate.available -= 1;
+        fd_gate.dir_retained += 2;
+        result = NO_ERROR;
     }
-    
-    paths_t *paths = calloc(1, sizeof(paths_t));
-    if (NULL == paths) {
-        return NULL;
+    pthread_mutex_unlock(&fd_gate.mutex);
+    return result;
+}
+
+void fd_release_dir(void) {
+    pthread_mutex_lock(&fd_gate.mutex);
+    fd_gate.available += 2;
+    fd_gate.dir_retained -= 2;
+    fd_gate.generation++;
+    pthread_cond_broadcast(&fd_gate.cond);
+    pthread_mutex_unlock(&fd_gate.mutex);
+}
+
+char *arena_alloc(size_t size) {
+    arena_chunk_t *chunk = path_arena;
+    if (NULL == chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        arena_chunk_t *fresh = malloc(sizeof(arena_chunk_t) + chunk_size);
+        if (NULL == fresh) {
+            return NULL;
+        }
+        fresh->next = chunk;
+        fresh->size = chunk_size;
+        fresh->used = 0;
+        path_arena = fresh;
+        chunk = fresh;
     }
+    char *result = chunk->data + chunk->used;
+    chunk->used += size;
+    return result;
+}
 
-    char *delimiter = IS_STRING_EMPTY(sub_path) ? "" : "/";
-    sub_path = IS_STRING_EMPTY(sub_path) ? "" : sub_path;
+void arena_reset(void) {
+    arena_chunk_t *chunk = path_arena;
+    while (NULL != chunk && NULL != chunk->next) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    if (NULL != chunk) {
+        chunk->used = 0;
+    }
+    path_arena = chunk;
+}
 
-    const char *full_srt_path[] = { src_path, delimiter, sub_path, NULL };
-    const char *full_sub_path[] = { dest_path, delimiter, sub_path, NULL };
+void arena_destroy(void) {
+    arena_reset();
+    free(path_arena);
+    path_arena = NULL;
+}
 
-    paths->src = concat_strings(full_srt_path);
-    paths->dest = concat_strings(full_sub_path);
+char *build_path(const dir_node_t *parent, const char *name, size_t name_length, int side) {
+    size_t length = root_lengths[side];
+    for (const dir_node_t *node = parent; NULL != node && NULL != node->parent; node = node->parent) {
+        length += node->name_length + 1;
+    }
+    if (NULL != parent) {
+        length += name_length + 1;
+    }
 
-    if (NULL == paths->src || NULL == paths->dest) {
-        free_paths(paths);
-        return NULL;
+    char *path = arena_alloc(length + 1);
+    if (NULL == path) {
+        return (char *)root_paths[side];
+    }
+
+    char *cursor = path + length;
+    *cursor = '\0';
+    if (NULL != parent) {
+        cursor -= name_length;
+        memcpy(cursor, name, name_length);
+        *--cursor = '/';
+    }
+    for (const dir_node_t *node = parent; NULL != node && NULL != node->parent; node = node->parent) {
+        cursor -= node->name_length;
+        memcpy(cursor, node->name, node->name_length);
+        *--cursor = '/';
     }
+    memcpy(path, root_paths[side], root_lengths[side]);
+    return path;
+}
 
-    return paths;
+char *entry_path(const entry_t *entry, int side) {
+    return build_path(entry->parent, entry->name, entry->name_length, side);
 }
 
-void traverse_directory(DIR *dir, struct dirent *entry_buf, paths_t *old_paths) {
-    if (NULL == old_paths) {
-        fprintf(stderr, "traverse_directory: invalid paths\n");
-        return;
+int entry_anchor(const entry_t *entry, int side, const char **name) {
+    const dir_node_t *parent = entry->parent;
+    if (NULL != parent && ERROR != parent->fds[side]) {
+        *name = entry->name;
+        return parent->fds[side];
     }
+    *name = entry_path(entry, side);
+    return AT_FDCWD;
+}
 
-    int errorCode;
-    struct dirent *result;
-
+int open_entry_as(const entry_t *entry, int side, const char *temp_name, int oflag, mode_t mode) {
+    const char *name;
+    int dirfd = entry_anchor(entry, side, &name);
+    if (NULL != temp_name) {
+        name = temp_name;
+    }
     while (1) {
-        errorCode = readdir_r(dir, entry_buf, &result);
-        if (NO_ERROR != errorCode) {
-            print_error(old_paths->src, errorCode);
-            break;
+        int fd = openat(dirfd, name, oflag | O_CLOEXEC, mode);
+        STATS_ADD(syscalls, 1);
+        if (ERROR != fd) {
+            return fd;
+        }
+        if (EINTR == errno) {
+            STATS_ADD(retries, 1);
+            continue;
         }
-        if (NULL == result) {
+        if (EMFILE != errno && ENFILE != errno) {
+            perror(entry_path(entry, side));
             break;
         }
+        STATS_ADD(retries, 1);
+        fd_wait_for_release();
+    }
+    return ERROR;
+}
 
-        if (STRINGS_EQUAL(entry_buf->d_name, ".") || STRINGS_EQUAL(entry_buf->d_name, "..")) {
-            continue;
-        }
+int open_entry(const entry_t *entry, int side, int oflag, mode_t mode) {
+    return open_entry_as(entry, side, NULL, oflag, mode);
+}
 
-        paths_t *new_paths = build_paths(old_paths->src, old_paths->dest, entry_buf->d_name);
-        if (NULL == new_paths) {
-            continue;
+void close_entry_fd(int fd, const entry_t *entry, int side) {
+    STATS_ADD(syscalls, 1);
+    if (ERROR == close(fd)) {
+        perror(entry_path(entry, side));
+    }
+    fd_release(1);
+}
+
+int is_ignored_xattr_error(int code) {
+    return ENOTSUP == code || EPERM == code || EACCES == code;
+}
+
+int for_each_xattr(int fd, const char *path, xattr_visit_t visit, void *context) {
+    STATS_ADD(syscalls, 1);
+    ssize_t list_size = flistxattr(fd, NULL, 0);
+    if (ERROR == list_size) {
+        if (ENOTSUP == errno) {
+            return NO_ERROR;
         }
+        perror(path);
+        return ERROR;
+    }
+    if (0 == list_size) {
+        return NO_ERROR;
+    }
+
+    char *names = malloc(list_size);
+    if (NULL == names) {
+        perror(path);
+        return ERROR;
+    }
+    STATS_ADD(syscalls, 1);
+    list_size = flistxattr(fd, names, list_size);
+    if (ERROR == list_size) {
+        perror(path);
+        free(names);
+        return ERROR;
+    }
 
-        if (NO_ERROR != create_thread_with_retry(new_paths)) {
-            free_paths(new_paths);
+    int result = NO_ERROR;
+    char *value = NULL;
+    size_t capacity = 0;
+    for (char *name = names; name < names + list_size; name += strlen(name) + 1) {
+        STATS_ADD(syscalls, 2);
+        ssize_t value_size = fgetxattr(fd, name, NULL, 0);
+        if (value_size > 0 && (size_t)value_size > capacity) {
+            char *grown = realloc(value, value_size);
+            if (NULL == grown) {
+                perror(path);
+                result = ERROR;
+                break;
+            }
+            value = grown;
+            capacity = value_size;
+        }
+        if (ERROR == value_size || ERROR == (value_size = fgetxattr(fd, name, value, value_size))) {
+            if (ENODATA != errno && !is_ignored_xattr_error(errno)) {
+                perror(path);
+                result = ERROR;
+            }
             continue;
         }
+        if (ERROR == visit(context, name, value, value_size)) {
+            result = ERROR;
+        }
     }
+    free(value);
+    free(names);
+    return result;
 }
 
-void copy_directory(paths_t *paths, mode_t mode) {
-    if (NULL == paths || NULL == paths->src || NULL == paths->dest) {
-        fprintf(stderr, "copy_directory: invalid paths\n");
-        return;
+int set_xattr(void *context, const char *name, const char *value, size_t size) {
+    const xattr_target_t *target = (const xattr_target_t *)context;
+    STATS_ADD(syscalls, 1);
+    if (ERROR == fsetxattr(target->fd, name, value, size, 0) && !is_ignored_xattr_error(errno)) {
+        perror(target->path);
+        return ERROR;
     }
+    return NO_ERROR;
+}
 
-    errno = 0;
-    if (ERROR == mkdir(paths->dest, mode) && errno == EEXIST) {
-        perror(paths->dest);
-        //exit(0);
-        return;
-    }
+int copy_xattrs(int src_fd, int dest_fd, const char *src_path, const char *dest_path) {
+    xattr_target_t target = { dest_fd, dest_path };
+    return for_each_xattr(src_fd, src_path, set_xattr, &target);
+}
 
-    DIR *dir = open_dir_with_retry(paths->src);
-    if (NULL == dir) {
-        return;
+int apply_metadata(int src_fd, int dest_fd, const struct stat *stat_buf, const char *src_path, const char *dest_path) {
+    int result = NO_ERROR;
+    STATS_ADD(syscalls, 3);
+    if (ERROR == fchown(dest_fd, stat_buf->st_uid, stat_buf->st_gid) && EPERM != errno) {
+        perror(dest_path);
+        result = ERROR;
     }
-    
-    struct dirent *entry = calloc(1 ,sizeof(struct dirent) + pathconf(paths->src, _PC_NAME_MAX) + 1);
-
-    if (NULL == entry) {
-        closedir(dir);
-        return;
+    if (ERROR == copy_xattrs(src_fd, dest_fd, src_path, dest_path)) {
+        result = ERROR;
     }
+    if (ERROR == fchmod(dest_fd, stat_buf->st_mode & 07777)) {
+        perror(dest_path);
+        result = ERROR;
+    }
+    struct timespec times[2] = { stat_buf->st_atim, stat_buf->st_mtim };
+    if (ERROR == futimens(dest_fd, times)) {
+        perror(dest_path);
+        result = ERROR;
+    }
+    return result;
+}
 
-    traverse_directory(dir, entry, paths);
+int apply_entry_metadata(int src_fd, int dest_fd, const struct stat *stat_buf, const entry_t *entry) {
+    return apply_metadata(src_fd, dest_fd, stat_buf, entry_path(entry, SIDE_SRC), entry_path(entry, SIDE_DEST));
+}
 
-    free(entry);
-    if (ERROR == closedir(dir)) {
-        perror(paths->src);
+int open_node(const dir_node_t *node, int side) {
+    const dir_node_t *parent = node->parent;
+    const char *name = node->name;
+    int dirfd = NULL != parent ? parent->fds[side] : ERROR;
+    if (ERROR == dirfd) {
+        name = build_path(node->parent, node->name, node->name_length, side);
+        dirfd = AT_FDCWD;
     }
+    STATS_ADD(syscalls, 1);
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (ERROR == fd) {
+        perror(build_path(node->parent, node->name, node->name_length, side));
+    }
+    return fd;
 }
 
-void copy_file_content(int src_fd, int dest_fd, paths_t *paths) {
-    if (NULL == paths) {
-        fprintf(stderr, "copy_file_content: invalid paths\n");
-        return;
+void apply_directory_metadata(dir_node_t *node) {
+    int fds[2] = { node->fds[SIDE_SRC], node->fds[SIDE_DEST] };
+    if (!node->retained) {
+        fd_acquire(2);
+        fds[SIDE_SRC] = open_node(node, SIDE_SRC);
+        fds[SIDE_DEST] = ERROR == fds[SIDE_SRC] ? ERROR : open_node(node, SIDE_DEST);
     }
-
-    char buf[BUF_SIZE];
-    while (1) {
-        ssize_t bytes_read = read(src_fd, buf, BUF_SIZE);
-        if (ERROR == bytes_read) {
-            perror(paths->src);
-            return;
-        }
-        if (0 == bytes_read) {
-            break;
+    if (ERROR != fds[SIDE_DEST]
+        && ERROR == apply_metadata(fds[SIDE_SRC], fds[SIDE_DEST], &node->stat_buf,
+                                   build_path(node->parent, node->name, node->name_length, SIDE_SRC),
+                                   build_path(node->parent, node->name, node->name_length, SIDE_DEST))) {
+        STATS_ADD(errors, 1);
+    }
+    if (!node->retained) {
+        for (int side = SIDE_SRC; side <= SIDE_DEST; side++) {
+            if (ERROR != fds[side]) {
+                close(fds[side]);
+            }
         }
+        fd_release(2);
+    }
+}
 
-        ssize_t offset = 0;
-        ssize_t bytes_written;
-        while (offset < bytes_read) {
-            bytes_written = write(dest_fd, buf + offset, bytes_read - offset);
-            if (ERROR == bytes_written) {
-                perror(paths->dest);
-                return;
-            }
-            offset += bytes_written;
+void node_release(dir_node_t *node) {
+    while (NULL != node && 1 == atomic_fetch_sub(&node->refs, 1)) {
+        dir_node_t *parent = node->parent;
+        if (options.metadata && NULL == options.archive_path) {
+            apply_directory_metadata(node);
+        }
+        if (node->retained) {
+            close(node->fds[SIDE_SRC]);
+            close(node->fds[SIDE_DEST]);
+            fd_release_dir();
         }
+        free(node->entries);
+        free(node);
+        node = parent;
     }
 }
 
-void copy_regular_file(paths_t *paths, mode_t mode) {
-    if (NULL == paths || NULL == paths->src || NULL == paths->dest) {
-        fprintf(stderr, "copy_regular_file: invalid paths\n");
-        return;
+void entry_done(entry_t *entry) {
+    node_release(entry->parent);
+}
+
+int deque_init(deque_t *deque) {
+    deque->tasks = calloc(DEQUE_INITIAL_CAPACITY, sizeof(task_t));
+    if (NULL == deque->tasks) {
+        return ERROR;
     }
+    deque->capacity = DEQUE_INITIAL_CAPACITY;
+    deque->head = 0;
+    deque->size = 0;
 
-    int src_fd = open_file_with_retry(paths->src, O_RDONLY, mode);
-    if (ERROR == src_fd) {
-        return;
+    int errorCode = pthread_mutex_init(&deque->mutex, NULL);
+    if (NO_ERROR != errorCode) {
+        print_error("Unable to init deque mutex", errorCode);
+        free(deque->tasks);
+        return ERROR;
     }
+    return NO_ERROR;
+}
 
-    int dest_fd = open_file_with_retry(paths->dest, O_WRONLY | O_CREAT | O_EXCL, mode);
-    if (ERROR == dest_fd) {
-        close(src_fd);
-        return;
+void deque_destroy(deque_t *deque) {
+    pthread_mutex_destroy(&deque->mutex);
+    free(deque->tasks);
+}
+
+int deque_grow(deque_t *deque) {
+    size_t capacity = deque->capacity * 2;
+    task_t *tasks = calloc(capacity, sizeof(task_t));
+    if (NULL == tasks) {
+        return ERROR;
+    }
+    for (size_t i = 0; i < deque->size; i++) {
+        tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
     }
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->capacity = capacity;
+    deque->head = 0;
+    return NO_ERROR;
+}
 
-    copy_file_content(src_fd, dest_fd, paths);
+int deque_push_bottom(deque_t *deque, task_t task) {
+    int result = NO_ERROR;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->size == deque->capacity) {
+        result = deque_grow(deque);
+    }
+    if (NO_ERROR == result) {
+        deque->tasks[(deque->head + deque->size) % deque->capacity] = task;
+        deque->size++;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return result;
+}
 
-    if (ERROR == close(src_fd)) {
-        perror(paths->src);
+int deque_pop_bottom(deque_t *deque, task_t *task) {
+    int result = ERROR;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->size > 0) {
+        deque->size--;
+        *task = deque->tasks[(deque->head + deque->size) % deque->capacity];
+        result = NO_ERROR;
     }
-    if (ERROR == close(dest_fd)) {
-        perror(paths->dest);
+    pthread_mutex_unlock(&deque->mutex);
+    return result;
+}
+
+int deque_steal_top(deque_t *deque, task_t *task) {
+    int result = ERROR;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->size > 0) {
+        *task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->size--;
+        result = NO_ERROR;
     }
+    pthread_mutex_unlock(&deque->mutex);
+    return result;
 }
 
-void *copy_path(void *param) {
-    if (NULL == param) {
-        fprintf(stderr, "copy_path: invalid param\n");
-        return NULL;
+int pool_submit(thread_pool_t *pool, task_func_t func, void *arg) {
+    task_t task = { func, arg };
+    deque_t *deque = &pool->injector;
+    if (NULL != current_worker && pool == current_worker->pool) {
+        deque = &current_worker->deque;
     }
 
-    paths_t *paths = (paths_t *)param;
-    struct stat stat_buf;
+    atomic_fetch_add(&pool->pending, 1);
+    if (NO_ERROR != deque_push_bottom(deque, task)) {
+        fprintf(stderr, "pool_submit: unable to queue task\n");
+        atomic_fetch_sub(&pool->pending, 1);
+        return ERROR;
+    }
 
-    if (ERROR == lstat(paths->src, &stat_buf)) {
-        perror(paths->src);
-        free_paths(paths);
-        return NULL;
+    atomic_fetch_add(&pool->queued, 1);
+    if (atomic_load(&pool->idle) > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->work_cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return NO_ERROR;
+}
+
+int pool_find_task(worker_t *worker, task_t *task) {
+    thread_pool_t *pool = worker->pool;
+    if (NO_ERROR == deque_pop_bottom(&worker->deque, task)) {
+        return NO_ERROR;
+    }
+    if (NO_ERROR == deque_steal_top(&pool->injector, task)) {
+        return NO_ERROR;
     }
 
-    if (S_ISDIR(stat_buf.st_mode)) {
-        copy_directory(paths, stat_buf.st_mode);
+    long start = rand_r(&worker->seed) % pool->size;
+    for (long i = 0; i < pool->size; i++) {
+        worker_t *victim = &pool->workers[(start + i) % pool->size];
+        if (victim != worker && NO_ERROR == deque_steal_top(&victim->deque, task)) {
+            return NO_ERROR;
+        }
     }
-    else if (S_ISREG(stat_buf.st_mode)) {
-        copy_regular_file(paths, stat_buf.st_mode);
+    return ERROR;
+}
+
+void pool_task_done(thread_pool_t *pool) {
+    if (1 == atomic_fetch_sub(&pool->pending, 1)) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->mutex);
     }
+}
+
+void pool_hold(thread_pool_t *pool) {
+    atomic_fetch_add(&pool->pending, 1);
+}
+
+void pool_release(thread_pool_t *pool) {
+    pool_task_done(pool);
+}
+
+void *worker_routine(void *param) {
+    worker_t *worker = (worker_t *)param;
+    thread_pool_t *pool = worker->pool;
+    current_worker = worker;
+
+    while (1) {
+        task_t task;
+        if (NO_ERROR == pool_find_task(worker, &task)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            task.func(task.arg);
+            arena_reset();
+            pool_task_done(pool);
+            continue;
+        }
 
-    free_paths(paths);
+        if (uring_is_busy(worker->ring)) {
+            uring_drain(worker->ring);
+            arena_reset();
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        atomic_fetch_add(&pool->idle, 1);
+        while (!pool->shutdown && 0 == atomic_load(&pool->queued)) {
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        }
+        atomic_fetch_sub(&pool->idle, 1);
+        int shutdown = pool->shutdown;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (shutdown) {
+            break;
+        }
+    }
+    arena_destroy();
+    free(dirent_buffer);
+    free(copy_buffer);
+    free(direct_buffer);
+    dirent_buffer = NULL;
+    copy_buffer = NULL;
+    direct_buffer = NULL;
     return NULL;
 }
 
-int main(int argc, char **argv) {
-    if (3 != argc) {
-        fprintf(stderr, "Usage: %s src_path dest_path\n", argv[0]);
-        return EXIT_SUCCESS;
+void pool_wait(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    while (0 != atomic_load(&pool->pending)) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
     }
+    pthread_mutex_unlock(&pool->mutex);
+}
 
-    paths_t *paths = build_paths(argv[1], argv[2], "");
-    if (NULL == paths) {
-        return EXIT_FAILURE;
+void pool_destroy(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (long i = 0; i < pool->started; i++) {
+        int errorCode = pthread_join(pool->workers[i].thread, NULL);
+        if (NO_ERROR != errorCode) {
+            print_error("Unable to join thread", errorCode);
+        }
+    }
+    for (long i = 0; i < pool->size; i++) {
+        deque_destroy(&pool->workers[i].deque);
+        if (ERROR != pool->workers[i].pipe_fds[0]) {
+            close(pool->workers[i].pipe_fds[0]);
+            close(pool->workers[i].pipe_fds[1]);
+        }
+        uring_destroy(pool->workers[i].ring);
     }
+    free(pool->workers);
+    deque_destroy(&pool->injector);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+int pool_init(thread_pool_t *pool, long size) {
+    memset(pool, 0, sizeof(thread_pool_t));
+    pool->workers = calloc(size, sizeof(worker_t));
+    if (NULL == pool->workers) {
+        perror("pool_init");
+        return ERROR;
+    }
+    if (NO_ERROR != deque_init(&pool->injector)) {
+        free(pool->workers);
+        return ERROR;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
 
-    copy_path(paths);
+    for (long i = 0; i < size; i++) {
+        worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        worker->seed = (unsigned int)i + 1;
+        worker->pipe_fds[0] = ERROR;
+        worker->pipe_fds[1] = ERROR;
+        if (NO_ERROR != deque_init(&worker->deque)) {
+            pool_destroy(pool);
+            return ERROR;
+        }
+        pool->size++;
+    }
 
-    pthread_exit(NULL);
-    return EXIT_FAILURE;
+    for (long i = 0; i < size; i++) {
+        int errorCode = pthread_create(&pool->workers[i].thread, NULL, worker_routine, &pool->workers[i]);
+        if (NO_ERROR != errorCode) {
+            print_error("Unable to create thread", errorCode);
+            break;
+        }
+        pool->started++;
+    }
+
+    if (pool->started < size) {
+        fprintf(stderr, "Created %ld out of %ld threads!\n", pool->started, size);
+    }
+    if (0 == pool->started) {
+        pool_destroy(pool);
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
+int stat_entry(const entry_t *entry, unsigned int mask, struct statx *statx_buf) {
+    const char *name;
+    int dirfd = entry_anchor(entry, SIDE_SRC, &name);
+    STATS_ADD(syscalls, 1);
+    if (ERROR == statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask, statx_buf)) {
+        perror(entry_path(entry, SIDE_SRC));
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
+char *scan_directory(int fd, dir_node_t *node, size_t *length, long *count) {
+    if (NULL == dirent_buffer) {
+        dirent_buffer = malloc(GETDENTS_BUF_SIZE);
+        if (NULL == dirent_buffer) {
+            return NULL;
+        }
+    }
+
+    size_t capacity = DIR_ENTRIES_INITIAL_CAPACITY;
+    char *entries = malloc(capacity);
+    if (NULL == entries) {
+        return NULL;
+    }
+    *length = 0;
+    *count = 0;
+
+    while (1) {
+        long bytes_read = syscall(SYS_getdents64, fd, dirent_buffer, GETDENTS_BUF_SIZE);
+        STATS_ADD(syscalls, 1);
+        if (ERROR == bytes_read) {
+            if (EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            perror(build_path(node->parent, node->name, node->name_length, SIDE_SRC));
+            break;
+        }
+        if (0 == bytes_read) {
+            break;
+        }
+
+        for (long offset = 0; offset < bytes_read; ) {
+            linux_dirent64_t *dirent = (linux_dirent64_t *)(dirent_buffer + offset);
+            offset += dirent->d_reclen;
+            if (STRINGS_EQUAL(dirent->d_name, ".") || STRINGS_EQUAL(dirent->d_name, "..")) {
+                continue;
+            }
+
+            size_t name_length = strlen(dirent->d_name);
+            size_t record_size = ALIGN_UP(offsetof(entry_t, name) + name_length + 1, sizeof(void *));
+            while (*length + record_size > capacity) {
+                capacity *= 2;
+                char *grown = realloc(entries, capacity);
+                if (NULL == grown) {
+                    return entries;
+                }
+                entries = grown;
+            }
+
+            entry_t *entry = (entry_t *)(entries + *length);
+            entry->parent = node;
+            entry->name_length = (unsigned int)name_length;
+            entry->type = dirent->d_type;
+            memcpy(entry->name, dirent->d_name, name_length + 1);
+            *length += record_size;
+            (*count)++;
+        }
+    }
+    return entries;
+}
+
+void traverse_directory(dir_node_t *node, size_t length) {
+    for (size_t offset = 0; offset < length; ) {
+        entry_t *entry = (entry_t *)(node->entries + offset);
+        offset += ALIGN_UP(offsetof(entry_t, name) + entry->name_length + 1, sizeof(void *));
+
+        if (NO_ERROR != pool_submit(&copy_pool, copy_path, entry)) {
+            entry_done(entry);
+        }
+    }
+}
+
+int is_directory_at(int dirfd, const char *name) {
+    int saved_errno = errno;
+    struct stat stat_buf;
+    int result = NO_ERROR == fstatat(dirfd, name, &stat_buf, AT_SYMLINK_NOFOLLOW) && S_ISDIR(stat_buf.st_mode);
+    errno = saved_errno;
+    return result;
+}
+
+void copy_directory(entry_t *entry) {
+    fd_acquire(1);
+    int src_fd = open_entry(entry, SIDE_SRC, O_RDONLY | O_DIRECTORY | O_NOFOLLOW, 0);
+    if (ERROR == src_fd) {
+        fd_release(1);
+        entry_done(entry);
+        return;
+    }
+
+    struct stat stat_buf;
+    const char *name;
+    int dirfd = entry_anchor(entry, SIDE_DEST, &name);
+    dir_node_t *node = NULL;
+    STATS_ADD(syscalls, 2);
+    if (ERROR == fstat(src_fd, &stat_buf)) {
+        perror(entry_path(entry, SIDE_SRC));
+    }
+    else if (NULL != options.archive_path ? ERROR == archive_add_directory(entry, &stat_buf, src_fd)
+             : ERROR == mkdirat(dirfd, name, options.metadata ? S_IRWXU : stat_buf.st_mode) && !(options.sync && EEXIST == errno && is_directory_at(dirfd, name))) {
+        perror(entry_path(entry, SIDE_DEST));
+    }
+    else if (NULL == (node = calloc(1, sizeof(dir_node_t)))) {
+        perror(entry_path(entry, SIDE_SRC));
+    }
+    if (NULL == node) {
+        STATS_ADD(errors, 1);
+        close_entry_fd(src_fd, entry, SIDE_SRC);
+        entry_done(entry);
+        return;
+    }
+    STATS_ADD(directories, 1);
+
+    node->parent = entry->parent;
+    node->name = entry->name;
+    node->name_length = entry->name_length;
+    node->stat_buf = stat_buf;
+    node->fds[SIDE_SRC] = ERROR;
+    node->fds[SIDE_DEST] = ERROR;
+    atomic_init(&node->refs, 1);
+
+    if (NO_ERROR == fd_try_retain_dir()) {
+        int dest_fd = NULL == options.archive_path ? open_entry(entry, SIDE_DEST, O_RDONLY | O_DIRECTORY, 0) : ERROR;
+        if (ERROR == dest_fd && NULL == options.archive_path) {
+            fd_release_dir();
+            fd_acquire(1);
+        }
+        else {
+            node->retained = 1;
+            node->fds[SIDE_SRC] = src_fd;
+            node->fds[SIDE_DEST] = dest_fd;
+        }
+    }
+
+    size_t length = 0;
+    long count = 0;
+    node->entries = scan_directory(src_fd, node, &length, &count);
+    if (!node->retained) {
+        close_entry_fd(src_fd, entry, SIDE_SRC);
+    }
+
+    if (NULL != node->entries) {
+        atomic_fetch_add(&node->refs, count);
+        traverse_directory(node, length);
+    }
+    node_release(node);
+}
+
+int is_fallback_error(int code) {
+    return EXDEV == code || EINVAL == code || ENOSYS == code || EOPNOTSUPP == code || EBADF == code;
+}
+
+int copy_range_copy_file_range(int src_fd, int dest_fd, off_t offset, off_t length, off_t *copied) {
+    off_t start = *copied;
+    while (*copied < length) {
+        loff_t off_in = offset + *copied;
+        loff_t off_out = off_in;
+        size_t chunk = length - *copied > MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE : length - *copied;
+
+        ssize_t bytes_copied = copy_file_range(src_fd, &off_in, dest_fd, &off_out, chunk, 0);
+        STATS_ADD(syscalls, 1);
+        if (ERROR == bytes_copied) {
+            if (EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            return start == *copied && is_fallback_error(errno) ? NOT_SUPPORTED : ERROR;
+        }
+        if (0 == bytes_copied) {
+            return start == *copied && length > 0 ? NOT_SUPPORTED : NO_ERROR;
+        }
+        *copied += bytes_copied;
+    }
+    return NO_ERROR;
+}
+
+int copy_range_sendfile(int src_fd, int dest_fd, off_t offset, off_t length, off_t *copied) {
+    off_t start = *copied;
+    if (ERROR == lseek(dest_fd, offset + *copied, SEEK_SET)) {
+        return NOT_SUPPORTED;
+    }
+    while (*copied < length) {
+        off_t off_in = offset + *copied;
+        size_t chunk = length - *copied > MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE : length - *copied;
+
+        ssize_t bytes_copied = sendfile(dest_fd, src_fd, &off_in, chunk);
+        STATS_ADD(syscalls, 1);
+        if (ERROR == bytes_copied) {
+            if (EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            return start == *copied && is_fallback_error(errno) ? NOT_SUPPORTED : ERROR;
+        }
+        if (0 == bytes_copied) {
+            return start == *copied && length > 0 ? NOT_SUPPORTED : NO_ERROR;
+        }
+        *copied += bytes_copied;
+    }
+    return NO_ERROR;
+}
+
+void close_worker_pipe(worker_t *worker) {
+    close(worker->pipe_fds[0]);
+    close(worker->pipe_fds[1]);
+    worker->pipe_fds[0] = ERROR;
+    worker->pipe_fds[1] = ERROR;
+}
+
+int copy_range_splice(int src_fd, int dest_fd, off_t offset, off_t length, off_t *copied) {
+    off_t start = *copied;
+    worker_t *worker = current_worker;
+    if (NULL == worker) {
+        return NOT_SUPPORTED;
+    }
+    if (ERROR == worker->pipe_fds[0] && ERROR == pipe2(worker->pipe_fds, O_CLOEXEC)) {
+        worker->pipe_fds[0] = ERROR;
+        worker->pipe_fds[1] = ERROR;
+        return NOT_SUPPORTED;
+    }
+
+    while (*copied < length) {
+        loff_t off_in = offset + *copied;
+        loff_t off_out = off_in;
+        size_t chunk = length - *copied > PIPE_CHUNK_SIZE ? PIPE_CHUNK_SIZE : length - *copied;
+
+        ssize_t bytes_in = splice(src_fd, &off_in, worker->pipe_fds[1], NULL, chunk, SPLICE_F_MOVE);
+        STATS_ADD(syscalls, 1);
+        if (ERROR == bytes_in) {
+            if (EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            return start == *copied && is_fallback_error(errno) ? NOT_SUPPORTED : ERROR;
+        }
+        if (0 == bytes_in) {
+            return start == *copied && length > 0 ? NOT_SUPPORTED : NO_ERROR;
+        }
+
+        while (bytes_in > 0) {
+            ssize_t bytes_out = splice(worker->pipe_fds[0], NULL, dest_fd, &off_out, bytes_in, SPLICE_F_MOVE);
+            STATS_ADD(syscalls, 1);
+            if (ERROR == bytes_out && EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            if (ERROR == bytes_out || 0 == bytes_out) {
+                int code = ERROR == bytes_out ? errno : EIO;
+                close_worker_pipe(worker);
+                errno = code;
+                return start == *copied && is_fallback_error(code) ? NOT_SUPPORTED : ERROR;
+            }
+            bytes_in -= bytes_out;
+            *copied += bytes_out;
+        }
+    }
+    return NO_ERROR;
+}
+
+char *get_copy_buffer(off_t length, size_t *size) {
+    size_t wanted = BUF_SIZE;
+    while (wanted < ADAPTIVE_BUF_MAX && (off_t)wanted < length) {
+        wanted *= 2;
+    }
+    if (copy_buffer_size < wanted) {
+        char *grown = realloc(copy_buffer, wanted);
+        if (NULL == grown) {
+            return NULL;
+        }
+        copy_buffer = grown;
+        copy_buffer_size = wanted;
+    }
+    *size = copy_buffer_size;
+    return copy_buffer;
+}
+
+int copy_range_read_write(int src_fd, int dest_fd, off_t offset, off_t length, off_t *copied, uint32_t *crc) {
+    char stack_buf[BUF_SIZE];
+    size_t buf_size = BUF_SIZE;
+    char *buf = get_copy_buffer(length - *copied, &buf_size);
+    if (NULL == buf) {
+        buf = stack_buf;
+        buf_size = BUF_SIZE;
+    }
+    while (*copied < length) {
+        size_t chunk = (size_t)(length - *copied) > buf_size ? buf_size : (size_t)(length - *copied);
+        ssize_t bytes_read = pread(src_fd, buf, chunk, offset + *copied);
+        STATS_ADD(syscalls, 1);
+        if (ERROR == bytes_read) {
+            if (EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            return ERROR;
+        }
+        if (0 == bytes_read) {
+            break;
+        }
+        if (NULL != crc) {
+            *crc = crc32c_update(*crc, buf, bytes_read);
+        }
+
+        ssize_t written = 0;
+        while (written < bytes_read) {
+            ssize_t bytes_written = pwrite(dest_fd, buf + written, bytes_read - written, offset + *copied + written);
+            STATS_ADD(syscalls, 1);
+            if (ERROR == bytes_written) {
+                if (EINTR == errno) {
+                    STATS_ADD(retries, 1);
+                    continue;
+                }
+                return ERROR;
+            }
+            written += bytes_written;
+        }
+        *copied += bytes_read;
+    }
+    return NO_ERROR;
+}
+
+int set_direct_io(int fd, int enable) {
+    int flags = fcntl(fd, F_GETFL);
+    if (ERROR == flags) {
+        return ERROR;
+    }
+    return fcntl(fd, F_SETFL, enable ? flags | O_DIRECT : flags & ~O_DIRECT);
+}
+
+int copy_range_direct(int src_fd, int dest_fd, off_t offset, off_t length, off_t *copied, uint32_t *crc) {
+    off_t aligned = length & ~(off_t)(DIRECT_ALIGNMENT - 1);
+    if (0 != offset % DIRECT_ALIGNMENT || 0 == aligned) {
+        return NOT_SUPPORTED;
+    }
+    if (NULL == direct_buffer && NO_ERROR != posix_memalign((void **)&direct_buffer, DIRECT_ALIGNMENT, DIRECT_BUF_SIZE)) {
+        direct_buffer = NULL;
+        return NOT_SUPPORTED;
+    }
+    if (ERROR == set_direct_io(src_fd, 1)) {
+        return NOT_SUPPORTED;
+    }
+    if (ERROR == set_direct_io(dest_fd, 1)) {
+        set_direct_io(src_fd, 0);
+        return NOT_SUPPORTED;
+    }
+
+    int result = NO_ERROR;
+    while (NO_ERROR == result && *copied < aligned) {
+        size_t chunk = aligned - *copied > DIRECT_BUF_SIZE ? DIRECT_BUF_SIZE : aligned - *copied;
+        ssize_t bytes_read = pread(src_fd, direct_buffer, chunk, offset + *copied);
+        STATS_ADD(syscalls, 1);
+        if (ERROR == bytes_read) {
+            if (EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            result = 0 == *copied && EINVAL == errno ? NOT_SUPPORTED : ERROR;
+            break;
+        }
+        bytes_read &= ~(ssize_t)(DIRECT_ALIGNMENT - 1);
+        if (0 == bytes_read) {
+            break;
+        }
+
+        ssize_t written = 0;
+        while (written < bytes_read) {
+            ssize_t bytes_written = pwrite(dest_fd, direct_buffer + written, bytes_read - written, offset + *copied + written);
+            STATS_ADD(syscalls, 1);
+            if (ERROR == bytes_written) {
+                if (EINTR == errno) {
+                    STATS_ADD(retries, 1);
+                    continue;
+                }
+                result = 0 == *copied && 0 == written && EINVAL == errno ? NOT_SUPPORTED : ERROR;
+                break;
+            }
+            written += bytes_written;
+        }
+        if (NULL != crc) {
+            *crc = crc32c_update(*crc, direct_buffer, written);
+        }
+        *copied += written;
+        if ((size_t)bytes_read < chunk) {
+            break;
+        }
+    }
+
+    int code = errno;
+    set_direct_io(src_fd, 0);
+    set_direct_io(dest_fd, 0);
+    errno = code;
+    return result;
+}
+
+void advise_range(int fd, off_t offset, off_t length, int advice) {
+    if (options.direct && length > 0) {
+        posix_fadvise(fd, offset, length, advice);
+    }
+}
+
+int copy_range_with(copy_strategy_t strategy, int src_fd, int dest_fd, off_t offset, off_t length, off_t *copied, uint32_t *crc) {
+    switch (strategy) {
+        case STRATEGY_COPY_FILE_RANGE:
+            return copy_range_copy_file_range(src_fd, dest_fd, offset, length, copied);
+        case STRATEGY_SENDFILE:
+            return copy_range_sendfile(src_fd, dest_fd, offset, length, copied);
+        case STRATEGY_SPLICE:
+            return copy_range_splice(src_fd, dest_fd, offset, length, copied);
+        default:
+            return copy_range_read_write(src_fd, dest_fd, offset, length, copied, crc);
+    }
+}
+
+int copy_range_tiers(int src_fd, int dest_fd, off_t offset, off_t length, int concurrent, copy_strategy_t *used, off_t *copied, uint32_t *crc) {
+    if (options.direct && length >= DIRECT_THRESHOLD) {
+        int result = copy_range_direct(src_fd, dest_fd, offset, length, copied, crc);
+        if (ERROR == result || *copied == length) {
+            *used = STRATEGY_READ_WRITE;
+            return result;
+        }
+    }
+
+    copy_strategy_t first = NULL != crc ? STRATEGY_READ_WRITE : options.strategy;
+    for (copy_strategy_t strategy = first; strategy < STRATEGY_COUNT; strategy++) {
+        if (STRATEGY_READ_WRITE != strategy && atomic_load(&strategy_disabled[strategy])) {
+            continue;
+        }
+        if (concurrent && STRATEGY_SENDFILE == strategy) {
+            continue;
+        }
+
+        errno = 0;
+        int result = copy_range_with(strategy, src_fd, dest_fd, offset, length, copied, crc);
+        if (NOT_SUPPORTED != result) {
+            *used = strategy;
+            return result;
+        }
+        STATS_ADD(retries, 1);
+        if (ENOSYS == errno) {
+            atomic_store(&strategy_disabled[strategy], 1);
+        }
+    }
+    return ERROR;
+}
+
+int copy_range(int src_fd, int dest_fd, off_t offset, off_t length, int concurrent, copy_strategy_t *used, uint32_t *crc) {
+    off_t copied = 0;
+    advise_range(src_fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    int result = copy_range_tiers(src_fd, dest_fd, offset, length, concurrent, used, &copied, crc);
+    STATS_ADD(bytes, copied);
+    advise_range(src_fd, offset, copied, POSIX_FADV_DONTNEED);
+    advise_range(dest_fd, offset, copied, POSIX_FADV_DONTNEED);
+    return result;
+}
+
+int is_sparse_file(const struct stat *stat_buf) {
+    return (off_t)stat_buf->st_blocks * 512 < stat_buf->st_size;
+}
+
+int copy_range_sparse(int src_fd, int dest_fd, off_t offset, off_t length, int concurrent, copy_strategy_t *used, off_t *skipped, uint32_t *crc) {
+    off_t end = offset + length;
+    *skipped = 0;
+    while (offset < end) {
+        off_t data = lseek(src_fd, offset, SEEK_DATA);
+        if (ERROR == data) {
+            if (ENXIO == errno) {
+                data = end;
+            }
+            else if (EINVAL == errno || EOPNOTSUPP == errno) {
+                return copy_range(src_fd, dest_fd, offset, end - offset, concurrent, used, crc);
+            }
+            else {
+                return ERROR;
+            }
+        }
+        if (data >= end) {
+            *skipped += end - offset;
+            if (NULL != crc) {
+                *crc = crc32c_zeros(*crc, end - offset);
+            }
+            break;
+        }
+
+        off_t hole = lseek(src_fd, data, SEEK_HOLE);
+        if (ERROR == hole || hole > end) {
+            hole = end;
+        }
+        *skipped += data - offset;
+        if (NULL != crc) {
+            *crc = crc32c_zeros(*crc, data - offset);
+        }
+        if (ERROR == copy_range(src_fd, dest_fd, data, hole - data, concurrent, used, crc)) {
+            return ERROR;
+        }
+        offset = hole;
+    }
+    return NO_ERROR;
+}
+
+void close_file_pair(int src_fd, int dest_fd, const entry_t *entry) {
+    close_entry_fd(src_fd, entry, SIDE_SRC);
+    close_entry_fd(dest_fd, entry, SIDE_DEST);
+}
+
+void close_source_file(int src_fd, const entry_t *entry) {
+    close_entry_fd(src_fd, entry, SIDE_SRC);
+    fd_release(1);
+}
+
+int open_source_file(const entry_t *entry, struct stat *stat_buf, int *src_fd) {
+    fd_acquire(2);
+    *src_fd = open_entry(entry, SIDE_SRC, O_RDONLY | O_NOFOLLOW, 0);
+    if (ERROR == *src_fd) {
+        fd_release(2);
+        return ERROR;
+    }
+
+    if (NULL != stat_buf) {
+        STATS_ADD(syscalls, 1);
+        if (ERROR == fstat(*src_fd, stat_buf)) {
+            perror(entry_path(entry, SIDE_SRC));
+            close_source_file(*src_fd, entry);
+            return ERROR;
+        }
+    }
+    return NO_ERROR;
+}
+
+int open_dest_file(const entry_t *entry, const char *temp_name, int dest_flags, mode_t mode, int src_fd, int *dest_fd) {
+    *dest_fd = open_entry_as(entry, SIDE_DEST, temp_name, dest_flags, mode);
+    if (ERROR == *dest_fd) {
+        close_source_file(src_fd, entry);
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
+int open_file_pair(const entry_t *entry, const char *temp_name, int dest_flags, struct stat *stat_buf, int *src_fd, int *dest_fd) {
+    if (ERROR == open_source_file(entry, stat_buf, src_fd)) {
+        return ERROR;
+    }
+    return open_dest_file(entry, temp_name, dest_flags, NULL != stat_buf ? stat_buf->st_mode : 0, *src_fd, dest_fd);
+}
+
+uint64_t hash_fd(int fd, int *status) {
+    char buf[HASH_BUF_SIZE];
+    uint64_t hash = HASH_PRIME;
+    off_t offset = 0;
+    *status = NO_ERROR;
+
+    while (1) {
+        ssize_t bytes_read = pread(fd, buf, HASH_BUF_SIZE, offset);
+        if (ERROR == bytes_read) {
+            if (EINTR == errno) {
+                continue;
+            }
+            *status = ERROR;
+            return 0;
+        }
+        if (0 == bytes_read) {
+            break;
+        }
+
+        ssize_t i = 0;
+        for (; i + 8 <= bytes_read; i += 8) {
+            uint64_t word;
+            memcpy(&word, buf + i, sizeof(word));
+            hash = (hash ^ word) * HASH_PRIME;
+            hash ^= hash >> 32;
+        }
+        for (; i < bytes_read; i++) {
+            hash = (hash ^ (unsigned char)buf[i]) * HASH_PRIME;
+        }
+        offset += bytes_read;
+    }
+    return hash ^ (uint64_t)offset;
+}
+
+int is_same_content(const entry_t *entry) {
+    int src_fd;
+    int dest_fd;
+    if (ERROR == open_file_pair(entry, NULL, O_RDONLY, NULL, &src_fd, &dest_fd)) {
+        return 0;
+    }
+
+    int src_status;
+    int dest_status;
+    uint64_t src_hash = hash_fd(src_fd, &src_status);
+    uint64_t dest_hash = hash_fd(dest_fd, &dest_status);
+    close_file_pair(src_fd, dest_fd, entry);
+    return NO_ERROR == src_status && NO_ERROR == dest_status && src_hash == dest_hash;
+}
+
+int is_unchanged(const entry_t *entry) {
+    struct stat src_stat;
+    struct stat dest_stat;
+    const char *name;
+    int dirfd = entry_anchor(entry, SIDE_SRC, &name);
+    if (ERROR == fstatat(dirfd, name, &src_stat, AT_SYMLINK_NOFOLLOW)) {
+        return 0;
+    }
+    dirfd = entry_anchor(entry, SIDE_DEST, &name);
+    if (ERROR == fstatat(dirfd, name, &dest_stat, AT_SYMLINK_NOFOLLOW)) {
+        return 0;
+    }
+
+    if (!S_ISREG(dest_stat.st_mode) || src_stat.st_size != dest_stat.st_size) {
+        return 0;
+    }
+    if (src_stat.st_mtim.tv_sec == dest_stat.st_mtim.tv_sec && src_stat.st_mtim.tv_nsec == dest_stat.st_mtim.tv_nsec) {
+        return 1;
+    }
+    if (!options.hash || !is_same_content(entry)) {
+        return 0;
+    }
+
+    struct timespec times[2] = { src_stat.st_atim, src_stat.st_mtim };
+    if (ERROR == utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW)) {
+        perror(entry_path(entry, SIDE_DEST));
+    }
+    return 1;
+}
+
+char *make_temp_name(const entry_t *entry) {
+    const char *name;
+    entry_anchor(entry, SIDE_DEST, &name);
+    const char *base = strrchr(name, '/');
+    base = NULL == base ? name : base + 1;
+
+    char suffix[TEMP_SUFFIX_MAX];
+    int suffix_length = snprintf(suffix, sizeof(suffix), ".lab7-%ld-%lu", (long)getpid(), atomic_fetch_add(&temp_counter, 1));
+    size_t prefix_length = (size_t)(base - name);
+    size_t base_length = strlen(base);
+    if (base_length + suffix_length + 1 > NAME_MAX) {
+        base_length = NAME_MAX - suffix_length - 1;
+    }
+
+    char *temp_name = arena_alloc(prefix_length + 1 + base_length + suffix_length + 1);
+    if (NULL == temp_name) {
+        return NULL;
+    }
+    memcpy(temp_name, name, prefix_length);
+    temp_name[prefix_length] = '.';
+    memcpy(temp_name + prefix_length + 1, base, base_length);
+    memcpy(temp_name + prefix_length + 1 + base_length, suffix, suffix_length + 1);
+    return temp_name;
+}
+
+int commit_temp_file(const entry_t *entry, const char *temp_name, const struct stat *stat_buf, int failed) {
+    const char *name;
+    int dirfd = entry_anchor(entry, SIDE_DEST, &name);
+    struct timespec times[2];
+    if (!failed) {
+        times[0] = stat_buf->st_atim;
+        times[1] = stat_buf->st_mtim;
+    }
+    if (!failed && !options.metadata && ERROR == utimensat(dirfd, temp_name, times, 0)) {
+        perror(entry_path(entry, SIDE_DEST));
+    }
+    if (!failed && NO_ERROR == renameat(dirfd, temp_name, dirfd, name)) {
+        return NO_ERROR;
+    }
+    if (!failed) {
+        perror(entry_path(entry, SIDE_DEST));
+    }
+    unlinkat(dirfd, temp_name, 0);
+    return ERROR;
+}
+
+const char *relative_dest_path(const char *path) {
+    path += root_lengths[SIDE_DEST];
+    while ('/' == *path) {
+        path++;
+    }
+    return path;
+}
+
+void manifest_push(char *path, const char *target, off_t size, uint32_t crc) {
+    pthread_mutex_lock(&manifest.mutex);
+    if (manifest.count == manifest.capacity) {
+        size_t capacity = 0 == manifest.capacity ? MANIFEST_INITIAL_CAPACITY : manifest.capacity * 2;
+        manifest_record_t *grown = realloc(manifest.records, capacity * sizeof(manifest_record_t));
+        if (NULL == grown) {
+            pthread_mutex_unlock(&manifest.mutex);
+            fprintf(stderr, "%s: unable to record checksum\n", path);
+            free(path);
+            return;
+        }
+        manifest.records = grown;
+        manifest.capacity = capacity;
+    }
+    manifest_record_t *record = &manifest.records[manifest.count++];
+    record->path = path;
+    record->target = target;
+    record->size = size;
+    record->crc = crc;
+    pthread_mutex_unlock(&manifest.mutex);
+}
+
+void manifest_add(const entry_t *entry, off_t size, uint32_t crc) {
+    char *path = entry_path(entry, SIDE_DEST);
+    char *copy = NULL == path ? NULL : strdup(relative_dest_path(path));
+    if (NULL == copy) {
+        fprintf(stderr, "%s: unable to record checksum\n", NULL == path ? entry->name : path);
+        return;
+    }
+    manifest_push(copy, NULL, size, crc);
+}
+
+void manifest_add_link(const entry_t *entry, const char *target_path) {
+    char *path = entry_path(entry, SIDE_DEST);
+    char *copy = NULL == path ? NULL : strdup(relative_dest_path(path));
+    if (NULL == copy) {
+        fprintf(stderr, "%s: unable to record checksum\n", NULL == path ? entry->name : path);
+        return;
+    }
+    manifest_push(copy, relative_dest_path(target_path), 0, 0);
+}
+
+uint32_t combine_block_crcs(const uint32_t *crcs, off_t size, off_t block_size) {
+    uint32_t crc = 0;
+    for (off_t offset = 0; offset < size; offset += block_size) {
+        off_t length = size - offset > block_size ? block_size : size - offset;
+        crc = crc32c_combine(crc, crcs[offset / block_size], length);
+    }
+    return crc;
+}
+
+int crc_fd(int fd, uint32_t *crc, off_t *size) {
+    size_t buf_size = BUF_SIZE;
+    char stack_buf[BUF_SIZE];
+    char *buf = get_copy_buffer(ADAPTIVE_BUF_MAX, &buf_size);
+    if (NULL == buf) {
+        buf = stack_buf;
+        buf_size = BUF_SIZE;
+    }
+
+    *crc = 0;
+    *size = 0;
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (ERROR == end) {
+        return ERROR;
+    }
+    off_t offset = 0;
+    while (offset < end) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        off_t hole = end;
+        if (ERROR == data && ENXIO == errno) {
+            data = end;
+        }
+        else if (ERROR == data) {
+            data = offset;
+        }
+        else if (ERROR == (hole = lseek(fd, data, SEEK_HOLE)) || hole > end) {
+            hole = end;
+        }
+        *crc = crc32c_zeros(*crc, data - offset);
+
+        for (offset = data; offset < hole; ) {
+            size_t chunk = (size_t)(hole - offset) > buf_size ? buf_size : (size_t)(hole - offset);
+            ssize_t bytes_read = pread(fd, buf, chunk, offset);
+            STATS_ADD(syscalls, 1);
+            if (ERROR == bytes_read) {
+                if (EINTR == errno) {
+                    continue;
+                }
+                return ERROR;
+            }
+            if (0 == bytes_read) {
+                *size = offset;
+                return NO_ERROR;
+            }
+            *crc = crc32c_update(*crc, buf, bytes_read);
+            offset += bytes_read;
+        }
+    }
+    *size = end;
+    return NO_ERROR;
+}
+
+void manifest_add_existing(const entry_t *entry) {
+    fd_acquire(1);
+    int fd = open_entry(entry, SIDE_DEST, O_RDONLY, 0);
+    if (ERROR == fd) {
+        fd_release(1);
+        return;
+    }
+    uint32_t crc;
+    off_t size;
+    if (ERROR == crc_fd(fd, &crc, &size)) {
+        perror(entry_path(entry, SIDE_DEST));
+    }
+    else {
+        manifest_add(entry, size, crc);
+    }
+    close_entry_fd(fd, entry, SIDE_DEST);
+}
+
+void write_manifest_path(FILE *file, const char *path) {
+    if ('\0' == *path) {
+        fputc('.', file);
+    }
+    for (; '\0' != *path; path++) {
+        if ('\\' == *path) {
+            fputs("\\\\", file);
+        }
+        else if ('\n' == *path) {
+            fputs("\\n", file);
+        }
+        else {
+            fputc(*path, file);
+        }
+    }
+    fputc('\n', file);
+}
+
+int compare_manifest_records(const void *first, const void *second) {
+    return strcmp(((const manifest_record_t *)first)->path, ((const manifest_record_t *)second)->path);
+}
+
+int write_manifest(const char *path) {
+    qsort(manifest.records, manifest.count, sizeof(manifest_record_t), compare_manifest_records);
+    for (size_t i = 0; i < manifest.count; i++) {
+        manifest_record_t *record = &manifest.records[i];
+        if (NULL == record->target) {
+            continue;
+        }
+        manifest_record_t key = { (char *)record->target, NULL, 0, 0 };
+        manifest_record_t *target = bsearch(&key, manifest.records, manifest.count, sizeof(manifest_record_t), compare_manifest_records);
+        if (NULL == target || NULL != target->target) {
+            fprintf(stderr, "%s: no checksum for link target %s\n", record->path, record->target);
+            continue;
+        }
+        record->size = target->size;
+        record->crc = target->crc;
+        record->target = NULL;
+    }
+
+    FILE *file = fopen(path, "w");
+    int result = NO_ERROR;
+    if (NULL == file) {
+        perror(path);
+        result = ERROR;
+    }
+    for (size_t i = 0; i < manifest.count; i++) {
+        if (NULL != file && NULL == manifest.records[i].target) {
+            fprintf(file, "%08x %lld ", manifest.records[i].crc, (long long)manifest.records[i].size);
+            write_manifest_path(file, manifest.records[i].path);
+        }
+        free(manifest.records[i].path);
+    }
+    if (NULL != file && ERROR == fclose(file)) {
+        perror(path);
+        result = ERROR;
+    }
+    free(manifest.records);
+    manifest.records = NULL;
+    manifest.count = 0;
+    manifest.capacity = 0;
+    return result;
+}
+
+// A failed chunked copy leaves a preallocated file of full size behind,
+// which would pass for a complete copy, so it is removed
+void discard_chunked_file(const entry_t *entry, const char *temp_name) {
+    if (NULL != temp_name) {
+        commit_temp_file(entry, temp_name, NULL, 1);
+        return;
+    }
+    const char *name;
+    int dirfd = entry_anchor(entry, SIDE_DEST, &name);
+    unlinkat(dirfd, name, 0);
+}
+
+void release_chunk_job(chunk_job_t *job, long count) {
+    if (count != atomic_fetch_sub(&job->remaining, count)) {
+        return;
+    }
+    if (options.verbose && !atomic_load(&job->failed)) {
+        printf("%s -> %s: %s, %ld chunks\n", entry_path(job->entry, SIDE_SRC), entry_path(job->entry, SIDE_DEST),
+               strategy_names[atomic_load(&job->used)], (long)((job->size + job->chunk_size - 1) / job->chunk_size));
+    }
+    atomic_fetch_add(&sparse_bytes_skipped, atomic_load(&job->skipped));
+    int result = atomic_load(&job->failed) ? ERROR : NO_ERROR;
+    int src_fd;
+    int dest_fd;
+    if (NO_ERROR == result && options.metadata) {
+        result = open_file_pair(job->entry, job->temp_name, O_WRONLY, NULL, &src_fd, &dest_fd);
+        if (NO_ERROR == result) {
+            result = apply_entry_metadata(src_fd, dest_fd, &job->stat_buf, job->entry);
+            close_file_pair(src_fd, dest_fd, job->entry);
+        }
+    }
+    if (NO_ERROR == result && 0 != job->dest_mode) {
+        const char *name;
+        int dirfd = entry_anchor(job->entry, SIDE_DEST, &name);
+        STATS_ADD(syscalls, 1);
+        if (ERROR == fchmodat(dirfd, NULL != job->temp_name ? job->temp_name : name, job->dest_mode & 07777, 0)) {
+            perror(entry_path(job->entry, SIDE_DEST));
+            result = ERROR;
+        }
+    }
+    if (ERROR == result) {
+        discard_chunked_file(job->entry, job->temp_name);
+    }
+    else if (NULL != job->temp_name) {
+        result = commit_temp_file(job->entry, job->temp_name, &job->stat_buf, 0);
+    }
+    free(job->temp_name);
+    if (NO_ERROR == result && NULL != job->crcs) {
+        manifest_add(job->entry, job->size, combine_block_crcs(job->crcs, job->size, job->chunk_size));
+    }
+    inode_map_settle(job->entry, &job->stat_buf, result);
+    stats_file_done(job->started, job->size, result);
+    entry_done(job->entry);
+    free(job->crcs);
+    free(job);
+}
+
+void copy_chunk(void *param) {
+    chunk_job_t *job = (chunk_job_t *)param;
+    long index = atomic_fetch_add(&job->next_chunk, 1);
+    off_t offset = index * job->chunk_size;
+    off_t length = job->size - offset > job->chunk_size ? job->chunk_size : job->size - offset;
+
+    int src_fd;
+    int dest_fd;
+    if (!atomic_load(&job->failed) && NO_ERROR == open_file_pair(job->entry, job->temp_name, O_WRONLY, NULL, &src_fd, &dest_fd)) {
+        copy_strategy_t used = options.strategy;
+        off_t skipped = 0;
+        uint32_t *crc = NULL == job->crcs ? NULL : &job->crcs[index];
+        int result = job->sparse
+                     ? copy_range_sparse(src_fd, dest_fd, offset, length, 1, &used, &skipped, crc)
+                     : copy_range(src_fd, dest_fd, offset, length, 1, &used, crc);
+        atomic_fetch_add(&job->skipped, skipped);
+        if (ERROR == result) {
+            if (0 == atomic_exchange(&job->failed, 1)) {
+                perror(entry_path(job->entry, SIDE_SRC));
+            }
+        }
+        atomic_store(&job->used, used);
+        close_file_pair(src_fd, dest_fd, job->entry);
+    }
+    else {
+        atomic_store(&job->failed, 1);
+    }
+    release_chunk_job(job, 1);
+}
+
+int preallocate_file(int fd, off_t size) {
+    if (NO_ERROR == fallocate(fd, 0, 0, size)) {
+        return NO_ERROR;
+    }
+    if (EOPNOTSUPP != errno && ENOSYS != errno) {
+        return ERROR;
+    }
+    return ftruncate(fd, size);
+}
+
+int is_chunked_file(off_t size) {
+    return options.chunk_threshold > 0 && copy_pool.size > 1 && size >= options.chunk_threshold;
+}
+
+int copy_file_chunked(int dest_fd, const struct stat *stat_buf, entry_t *entry, const char *temp_name, long long started) {
+    off_t size = stat_buf->st_size;
+    int sparse = is_sparse_file(stat_buf);
+    if (ERROR == (sparse ? ftruncate(dest_fd, size) : preallocate_file(dest_fd, size))) {
+        perror(entry_path(entry, SIDE_DEST));
+        return ERROR;
+    }
+    // Every chunk reopens the destination for writing, so a mode without
+    // owner write is only applied once the last chunk is done
+    struct stat dest_stat;
+    mode_t dest_mode = 0;
+    if (!options.metadata && 0 == (stat_buf->st_mode & S_IWUSR)) {
+        STATS_ADD(syscalls, 2);
+        if (ERROR == fstat(dest_fd, &dest_stat) || ERROR == fchmod(dest_fd, S_IRUSR | S_IWUSR)) {
+            perror(entry_path(entry, SIDE_DEST));
+            return ERROR;
+        }
+        dest_mode = dest_stat.st_mode;
+    }
+
+    chunk_job_t *job = calloc(1, sizeof(chunk_job_t));
+    if (NULL == job) {
+        return ERROR;
+    }
+    if (NULL != temp_name && NULL == (job->temp_name = strdup(temp_name))) {
+        free(job);
+        return ERROR;
+    }
+    long chunks = (size + options.chunk_size - 1) / options.chunk_size;
+    if (NULL != options.manifest_path && NULL == (job->crcs = calloc(chunks, sizeof(uint32_t)))) {
+        free(job->temp_name);
+        free(job);
+        return ERROR;
+    }
+    job->entry = entry;
+    job->stat_buf = *stat_buf;
+    job->size = size;
+    job->chunk_size = options.chunk_size;
+    job->sparse = sparse;
+    job->dest_mode = dest_mode;
+    job->started = started;
+    atomic_init(&job->skipped, 0);
+    atomic_init(&job->next_chunk, 0);
+    atomic_init(&job->remaining, chunks);
+    atomic_init(&job->failed, 0);
+    atomic_init(&job->used, options.strategy);
+
+    for (long i = 0; i < chunks; i++) {
+        if (NO_ERROR != pool_submit(&copy_pool, copy_chunk, job)) {
+            atomic_store(&job->failed, 1);
+            if (0 == i) {
+                free(job->temp_name);
+                free(job->crcs);
+                free(job);
+                return ERROR;
+            }
+            release_chunk_job(job, chunks - i);
+            break;
+        }
+    }
+    return HANDED_OFF;
+}
+
+int copy_file_content(int src_fd, int dest_fd, const struct stat *stat_buf, const entry_t *entry, uint32_t *crc) {
+    if (NULL == entry || NULL == stat_buf) {
+        fprintf(stderr, "copy_file_content: invalid entry\n");
+        return ERROR;
+    }
+
+    copy_strategy_t used = options.strategy;
+    off_t skipped = 0;
+    int result = is_sparse_file(stat_buf)
+                 ? copy_range_sparse(src_fd, dest_fd, 0, stat_buf->st_size, 0, &used, &skipped, crc)
+                 : copy_range(src_fd, dest_fd, 0, stat_buf->st_size, 0, &used, crc);
+    if (ERROR == result) {
+        perror(entry_path(entry, SIDE_SRC));
+        return ERROR;
+    }
+    if (skipped > 0 && ERROR == ftruncate(dest_fd, stat_buf->st_size)) {
+        perror(entry_path(entry, SIDE_DEST));
+        return ERROR;
+    }
+    atomic_fetch_add(&sparse_bytes_skipped, skipped);
+
+    if (options.verbose && skipped > 0) {
+        printf("%s -> %s: %s, %lld bytes in holes\n", entry_path(entry, SIDE_SRC), entry_path(entry, SIDE_DEST),
+               strategy_names[used], (long long)skipped);
+    }
+    else if (options.verbose) {
+        printf("%s -> %s: %s\n", entry_path(entry, SIDE_SRC), entry_path(entry, SIDE_DEST), strategy_names[used]);
+    }
+    return NO_ERROR;
+}
+
+ssize_t pipeline_read_block(int fd, char *buffer, off_t offset, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t bytes_read = pread(fd, buffer + done, length - done, offset + done);
+        STATS_ADD(syscalls, 1);
+        if (ERROR == bytes_read) {
+            if (EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            return ERROR;
+        }
+        if (0 == bytes_read) {
+            break;
+        }
+        done += bytes_read;
+    }
+    return (ssize_t)done;
+}
+
+int write_block_at(int fd, const char *buffer, off_t offset, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t bytes_written = pwrite(fd, buffer + done, length - done, offset + done);
+        STATS_ADD(syscalls, 1);
+        if (ERROR == bytes_written) {
+            if (EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            return ERROR;
+        }
+        done += bytes_written;
+    }
+    STATS_ADD(bytes, done);
+    return NO_ERROR;
+}
+
+void pipeline_fail_job(pipeline_job_t *job, int side, int code) {
+    if (!job->failed) {
+        print_error(entry_path(job->entry, side), code);
+    }
+    job->failed = 1;
+}
+
+void pipeline_finish_job(pipeline_job_t *job) {
+    if (options.verbose && !job->failed) {
+        printf("%s -> %s: pipelined\n", entry_path(job->entry, SIDE_SRC), entry_path(job->entry, SIDE_DEST));
+    }
+    advise_range(job->src_fd, 0, job->size, POSIX_FADV_DONTNEED);
+    advise_range(job->dest_fd, 0, job->size, POSIX_FADV_DONTNEED);
+    if (!job->failed && options.metadata && ERROR == apply_entry_metadata(job->src_fd, job->dest_fd, &job->stat_buf, job->entry)) {
+        job->failed = 1;
+    }
+    close_file_pair(job->src_fd, job->dest_fd, job->entry);
+    int result = job->failed ? ERROR : NO_ERROR;
+    if (NULL != job->temp_name) {
+        result = commit_temp_file(job->entry, job->temp_name, &job->stat_buf, job->failed);
+        free(job->temp_name);
+    }
+    if (NO_ERROR == result && NULL != job->crcs) {
+        manifest_add(job->entry, job->size, combine_block_crcs(job->crcs, job->size, PIPELINE_BUFFER_SIZE));
+    }
+    inode_map_settle(job->entry, &job->stat_buf, result);
+    stats_file_done(job->started, job->size, result);
+    entry_done(job->entry);
+    free(job->crcs);
+    free(job);
+    arena_reset();
+    pool_release(&copy_pool);
+}
+
+void *pipeline_reader(void *param) {
+    pipeline_t *stages = (pipeline_t *)param;
+    pthread_mutex_lock(&stages->mutex);
+    while (1) {
+        while (!stages->shutdown && (NULL == stages->jobs_head || 0 == stages->free_count)) {
+            pthread_cond_wait(&stages->read_cond, &stages->mutex);
+        }
+        if (stages->shutdown) {
+            break;
+        }
+
+        pipeline_job_t *job = stages->jobs_head;
+        pipeline_block_t block = { job, stages->free_buffers[--stages->free_count], job->next_offset, 0 };
+        job->next_offset += PIPELINE_BUFFER_SIZE;
+        if (job->next_offset >= job->size) {
+            stages->jobs_head = job->next;
+            if (NULL == stages->jobs_head) {
+                stages->jobs_tail = NULL;
+            }
+        }
+        int failed = job->failed;
+        pthread_mutex_unlock(&stages->mutex);
+
+        int code = 0;
+        if (!failed) {
+            size_t length = job->size - block.offset > PIPELINE_BUFFER_SIZE ? PIPELINE_BUFFER_SIZE : job->size - block.offset;
+            block.length = pipeline_read_block(job->src_fd, block.buffer, block.offset, length);
+            code = errno;
+            if (NULL != job->crcs && block.length > 0) {
+                job->crcs[block.offset / PIPELINE_BUFFER_SIZE] = crc32c_update(0, block.buffer, block.length);
+            }
+        }
+
+        pthread_mutex_lock(&stages->mutex);
+        if (ERROR == block.length) {
+            pipeline_fail_job(job, SIDE_SRC, code);
+            block.length = 0;
+        }
+        stages->filled[(stages->filled_head + stages->filled_count) % stages->buffer_count] = block;
+        stages->filled_count++;
+        pthread_cond_signal(&stages->write_cond);
+    }
+    pthread_mutex_unlock(&stages->mutex);
+    arena_destroy();
+    return NULL;
+}
+
+void *pipeline_writer(void *param) {
+    pipeline_t *stages = (pipeline_t *)param;
+    pthread_mutex_lock(&stages->mutex);
+    while (1) {
+        while (!stages->shutdown && 0 == stages->filled_count) {
+            pthread_cond_wait(&stages->write_cond, &stages->mutex);
+        }
+        if (0 == stages->filled_count) {
+            break;
+        }
+
+        pipeline_block_t block = stages->filled[stages->filled_head];
+        stages->filled_head = (stages->filled_head + 1) % stages->buffer_count;
+        stages->filled_count--;
+        pipeline_job_t *job = block.job;
+        int failed = job->failed;
+        pthread_mutex_unlock(&stages->mutex);
+
+        int result = NO_ERROR;
+        if (!failed && block.length > 0) {
+            result = write_block_at(job->dest_fd, block.buffer, block.offset, block.length);
+        }
+        int code = errno;
+
+        pthread_mutex_lock(&stages->mutex);
+        if (ERROR == result) {
+            pipeline_fail_job(job, SIDE_DEST, code);
+        }
+        stages->free_buffers[stages->free_count++] = block.buffer;
+        pthread_cond_signal(&stages->read_cond);
+        if (0 == --job->remaining) {
+            pthread_mutex_unlock(&stages->mutex);
+            pipeline_finish_job(job);
+            pthread_mutex_lock(&stages->mutex);
+        }
+    }
+    pthread_mutex_unlock(&stages->mutex);
+    arena_destroy();
+    return NULL;
+}
+
+void pipeline_destroy(pipeline_t *stages) {
+    pthread_mutex_lock(&stages->mutex);
+    stages->shutdown = 1;
+    pthread_cond_broadcast(&stages->read_cond);
+    pthread_cond_broadcast(&stages->write_cond);
+    pthread_mutex_unlock(&stages->mutex);
+
+    for (long i = 0; i < stages->started; i++) {
+        int errorCode = pthread_join(stages->threads[i], NULL);
+        if (NO_ERROR != errorCode) {
+            print_error("Unable to join thread", errorCode);
+        }
+    }
+    free(stages->threads);
+    free(stages->free_buffers);
+    free(stages->filled);
+    free(stages->memory);
+    pthread_cond_destroy(&stages->read_cond);
+    pthread_cond_destroy(&stages->write_cond);
+    pthread_mutex_destroy(&stages->mutex);
+    memset(stages, 0, sizeof(pipeline_t));
+}
+
+int pipeline_init(pipeline_t *stages, long readers, long writers) {
+    memset(stages, 0, sizeof(pipeline_t));
+    stages->buffer_count = PIPELINE_BUFFERS_PER_THREAD * (readers + writers);
+    stages->threads = calloc(readers + writers, sizeof(pthread_t));
+    stages->free_buffers = calloc(stages->buffer_count, sizeof(char *));
+    stages->filled = calloc(stages->buffer_count, sizeof(pipeline_block_t));
+    int errorCode = posix_memalign((void **)&stages->memory, PIPELINE_BUFFER_ALIGNMENT, stages->buffer_count * PIPELINE_BUFFER_SIZE);
+    if (NO_ERROR != errorCode || NULL == stages->threads || NULL == stages->free_buffers || NULL == stages->filled) {
+        print_error("pipeline_init", NO_ERROR != errorCode ? errorCode : ENOMEM);
+        if (NO_ERROR != errorCode) {
+            stages->memory = NULL;
+        }
+        free(stages->threads);
+        free(stages->free_buffers);
+        free(stages->filled);
+        free(stages->memory);
+        return ERROR;
+    }
+    for (long i = 0; i < stages->buffer_count; i++) {
+        stages->free_buffers[i] = stages->memory + i * PIPELINE_BUFFER_SIZE;
+    }
+    stages->free_count = stages->buffer_count;
+    pthread_mutex_init(&stages->mutex, NULL);
+    pthread_cond_init(&stages->read_cond, NULL);
+    pthread_cond_init(&stages->write_cond, NULL);
+
+    for (long i = 0; i < readers + writers; i++) {
+        errorCode = pthread_create(&stages->threads[i], NULL, i < readers ? pipeline_reader : pipeline_writer, stages);
+        if (NO_ERROR != errorCode) {
+            print_error("Unable to create thread", errorCode);
+            pipeline_destroy(stages);
+            return ERROR;
+        }
+        stages->started++;
+    }
+    stages->readers = readers;
+    stages->writers = writers;
+    return NO_ERROR;
+}
+
+int is_pipelined_file(int dest_fd, const struct stat *stat_buf) {
+    if (0 == pipeline.readers || stat_buf->st_size <= PIPELINE_BUFFER_SIZE || is_sparse_file(stat_buf)) {
+        return 0;
+    }
+    struct stat dest_stat;
+    STATS_ADD(syscalls, 1);
+    return NO_ERROR == fstat(dest_fd, &dest_stat) && dest_stat.st_dev != stat_buf->st_dev;
+}
+
+int pipeline_submit(int src_fd, int dest_fd, const struct stat *stat_buf, entry_t *entry, const char *temp_name, long long started) {
+    pipeline_job_t *job = calloc(1, sizeof(pipeline_job_t));
+    if (NULL == job) {
+        return ERROR;
+    }
+    if (NULL != temp_name && NULL == (job->temp_name = strdup(temp_name))) {
+        free(job);
+        return ERROR;
+    }
+    job->remaining = (stat_buf->st_size + PIPELINE_BUFFER_SIZE - 1) / PIPELINE_BUFFER_SIZE;
+    if (NULL != options.manifest_path && NULL == (job->crcs = calloc(job->remaining, sizeof(uint32_t)))) {
+        free(job->temp_name);
+        free(job);
+        return ERROR;
+    }
+    job->entry = entry;
+    job->stat_buf = *stat_buf;
+    job->src_fd = src_fd;
+    job->dest_fd = dest_fd;
+    job->size = stat_buf->st_size;
+    job->started = started;
+    advise_range(src_fd, 0, job->size, POSIX_FADV_SEQUENTIAL);
+
+    pool_hold(&copy_pool);
+    pthread_mutex_lock(&pipeline.mutex);
+    if (NULL == pipeline.jobs_tail) {
+        pipeline.jobs_head = job;
+    }
+    else {
+        pipeline.jobs_tail->next = job;
+    }
+    pipeline.jobs_tail = job;
+    pthread_cond_broadcast(&pipeline.read_cond);
+    pthread_mutex_unlock(&pipeline.mutex);
+    return HANDED_OFF;
+}
+
+#ifdef HAVE_IO_URING
+
+enum uring_op {
+    URING_OP_OPEN_SRC,
+    URING_OP_STATX,
+    URING_OP_OPEN_DEST,
+    URING_OP_READ,
+    URING_OP_WRITE,
+    URING_OP_CLOSE
+};
+
+typedef struct uring_slot {
+    entry_t *entry;
+    off_t size;
+    mode_t mode;
+    int src_fd;
+    int dest_fd;
+    int stage;
+    int dest_dirfd;
+    const char *dest_name;
+    char *dest_name_copy;
+    int handed_off;
+    int cloned;
+    struct statx statx_buf;
+    off_t offset;
+    unsigned int length;
+    unsigned int written;
+    int pending_ops;
+    int failed;
+    int closing;
+    long long started;
+    uint32_t crc;
+    char *buffer;
+} uring_slot_t;
+
+typedef struct uring {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int to_submit;
+    int fixed_buffers;
+    int active;
+    char *buffers;
+    uring_slot_t slots[URING_SLOTS];
+} uring_t;
+
+int uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_supports_ops(int fd) {
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (NULL == probe) {
+        return 0;
+    }
+
+    int supported = 0;
+    if (ERROR != uring_register(fd, IORING_REGISTER_PROBE, probe, 256)) {
+        const int required[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_CLOSE, IORING_OP_READ,
+                                 IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED };
+        supported = 1;
+        for (size_t i = 0; i < sizeof(required) / sizeof(required[0]); i++) {
+            if (required[i] > probe->last_op || !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = 0;
+            }
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+void uring_destroy(uring_t *ring) {
+    if (NULL == ring) {
+        return;
+    }
+    uring_drain(ring);
+    if (NULL != ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (NULL != ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (NULL != ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ERROR != ring->fd) {
+        close(ring->fd);
+    }
+    free(ring->buffers);
+    free(ring);
+}
+
+uring_t *uring_create(void) {
+    uring_t *ring = calloc(1, sizeof(uring_t));
+    if (NULL == ring) {
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = uring_setup(URING_ENTRIES, &params);
+    if (ERROR == ring->fd || !uring_supports_ops(ring->fd)) {
+        if (ERROR != ring->fd) {
+            errno = EOPNOTSUPP;
+        }
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == ring->sq_ring) {
+        ring->sq_ring = NULL;
+        uring_destroy(ring);
+        return NULL;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == ring->cq_ring) {
+            ring->cq_ring = NULL;
+            uring_destroy(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == ring->sqes) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (NO_ERROR != posix_memalign((void **)&ring->buffers, 4096, (size_t)URING_SLOTS * URING_BUFFER_SIZE)) {
+        ring->buffers = NULL;
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    struct iovec iovecs[URING_SLOTS];
+    for (int i = 0; i < URING_SLOTS; i++) {
+        ring->slots[i].buffer = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+        iovecs[i].iov_base = ring->slots[i].buffer;
+        iovecs[i].iov_len = URING_BUFFER_SIZE;
+    }
+    ring->fixed_buffers = ERROR != uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, URING_SLOTS);
+    return ring;
+}
+
+int uring_submit(uring_t *ring, unsigned int wait_for) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->to_submit, __ATOMIC_RELEASE);
+    unsigned int to_submit = ring->to_submit;
+    ring->to_submit = 0;
+
+    while (1) {
+        int submitted = uring_enter(ring->fd, to_submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+        STATS_ADD(syscalls, 1);
+        if (ERROR != submitted) {
+            return NO_ERROR;
+        }
+        if (EINTR != errno) {
+            print_error("io_uring_enter", errno);
+            return ERROR;
+        }
+        STATS_ADD(retries, 1);
+    }
+}
+
+// Returns NULL only when the ring stays full after handing the queued
+// entries to the kernel; callers fail the slot rather than queue more
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *ring->sq_tail + ring->to_submit;
+    if (tail - head >= ring->sq_entries) {
+        if (NO_ERROR != uring_submit(ring, 0)) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        tail = *ring->sq_tail;
+        if (tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->to_submit++;
+    return sqe;
+}
+
+void uring_prepare(struct io_uring_sqe *sqe, int opcode, int slot, int op) {
+    sqe->opcode = (unsigned char)opcode;
+    sqe->user_data = ((unsigned long long)slot << 8) | (unsigned long long)op;
+}
+
+int uring_queue_open(uring_t *ring, int slot, int op, int dirfd, const char *name, int flags, mode_t mode) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (NULL == sqe) {
+        return ERROR;
+    }
+    uring_prepare(sqe, IORING_OP_OPENAT, slot, op);
+    sqe->fd = dirfd;
+    sqe->addr = (unsigned long long)(uintptr_t)name;
+    sqe->open_flags = (unsigned int)flags;
+    sqe->len = mode;
+    ring->slots[slot].stage = op;
+    ring->slots[slot].pending_ops++;
+    return NO_ERROR;
+}
+
+int uring_queue_statx(uring_t *ring, int slot) {
+    uring_slot_t *entry = &ring->slots[slot];
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (NULL == sqe) {
+        return ERROR;
+    }
+    uring_prepare(sqe, IORING_OP_STATX, slot, URING_OP_STATX);
+    sqe->fd = entry->src_fd;
+    sqe->addr = (unsigned long long)(uintptr_t)"";
+    sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_BLOCKS | STATX_NLINK | STATX_UID | STATX_GID | STATX_ATIME | STATX_MTIME;
+    sqe->statx_flags = AT_EMPTY_PATH;
+    sqe->off = (unsigned long long)(uintptr_t)&entry->statx_buf;
+    entry->stage = URING_OP_STATX;
+    entry->pending_ops++;
+    return NO_ERROR;
+}
+
+int uring_queue_io(uring_t *ring, int slot, int op) {
+    uring_slot_t *entry = &ring->slots[slot];
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (NULL == sqe) {
+        return ERROR;
+    }
+    if (URING_OP_READ == op) {
+        uring_prepare(sqe, ring->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ, slot, op);
+        sqe->fd = entry->src_fd;
+        sqe->addr = (unsigned long long)(uintptr_t)entry->buffer;
+        off_t left = entry->size - entry->offset;
+        sqe->len = left > URING_BUFFER_SIZE ? URING_BUFFER_SIZE : (unsigned int)left;
+        sqe->off = (unsigned long long)entry->offset;
+    }
+    else {
+        uring_prepare(sqe, ring->fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, slot, op);
+        sqe->fd = entry->dest_fd;
+        sqe->addr = (unsigned long long)(uintptr_t)(entry->buffer + entry->written);
+        sqe->len = entry->length - entry->written;
+        sqe->off = (unsigned long long)(entry->offset + entry->written);
+    }
+    if (ring->fixed_buffers) {
+        sqe->buf_index = (unsigned short)slot;
+    }
+    entry->pending_ops++;
+    return NO_ERROR;
+}
+
+void uring_queue_close(uring_t *ring, int slot) {
+    uring_slot_t *entry = &ring->slots[slot];
+    entry->closing = 1;
+    int fds[2] = { entry->src_fd, entry->dest_fd };
+    for (int i = 0; i < 2; i++) {
+        if (ERROR == fds[i]) {
+            continue;
+        }
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        if (NULL == sqe) {
+            STATS_ADD(syscalls, 1);
+            close(fds[i]);
+            continue;
+        }
+        uring_prepare(sqe, IORING_OP_CLOSE, slot, URING_OP_CLOSE);
+        sqe->fd = fds[i];
+        entry->pending_ops++;
+    }
+}
+
+void uring_finish_slot(uring_t *ring, int slot) {
+    uring_slot_t *entry = &ring->slots[slot];
+    if (options.verbose && !entry->failed && !entry->handed_off && !entry->cloned) {
+        printf("%s -> %s: io_uring\n", entry_path(entry->entry, SIDE_SRC), entry_path(entry->entry, SIDE_DEST));
+    }
+    if (!entry->handed_off) {
+        if (!entry->failed && NULL != options.manifest_path) {
+            manifest_add(entry->entry, entry->size, entry->crc);
+        }
+        stats_file_done(entry->started, entry->size, entry->failed ? ERROR : NO_ERROR);
+        entry_done(entry->entry);
+    }
+    free(entry->dest_name_copy);
+    entry->dest_name_copy = NULL;
+    entry->entry = NULL;
+    ring->active--;
+    fd_release(2);
+    pool_release(&copy_pool);
+}
+
+void uring_fail_slot(uring_slot_t *entry, int side, int code) {
+    if (!entry->failed) {
+        print_error(entry_path(entry->entry, side), code);
+    }
+    entry->failed = 1;
+}
+
+void uring_apply_metadata(uring_slot_t *entry) {
+    struct stat stat_buf;
+    stat_buf.st_uid = entry->statx_buf.stx_uid;
+    stat_buf.st_gid = entry->statx_buf.stx_gid;
+    stat_buf.st_mode = entry->mode;
+    stat_buf.st_atim.tv_sec = entry->statx_buf.stx_atime.tv_sec;
+    stat_buf.st_atim.tv_nsec = entry->statx_buf.stx_atime.tv_nsec;
+    stat_buf.st_mtim.tv_sec = entry->statx_buf.stx_mtime.tv_sec;
+    stat_buf.st_mtim.tv_nsec = entry->statx_buf.stx_mtime.tv_nsec;
+    if (ERROR == apply_entry_metadata(entry->src_fd, entry->dest_fd, &stat_buf, entry->entry)) {
+        entry->failed = 1;
+    }
+}
+
+void uring_hand_off(uring_slot_t *entry) {
+    entry->handed_off = 1;
+    if (NO_ERROR != pool_submit(&copy_pool, copy_file_blocking, entry->entry)) {
+        entry->handed_off = 0;
+        entry->failed = 1;
+    }
+}
+
+void uring_advance(uring_t *ring, int slot) {
+    uring_slot_t *entry = &ring->slots[slot];
+    if (entry->pending_ops > 0) {
+        return;
+    }
+    if (entry->closing) {
+        uring_finish_slot(ring, slot);
+        return;
+    }
+    if (!entry->failed) {
+        int queued = ERROR;
+        switch (entry->stage) {
+            case URING_OP_OPEN_SRC:
+                queued = uring_queue_statx(ring, slot);
+                break;
+            case URING_OP_STATX:
+                if (!S_ISREG(entry->mode)) {
+                    queued = NOT_SUPPORTED;
+                    break;
+                }
+                if (is_chunked_file(entry->size) || (off_t)entry->statx_buf.stx_blocks * 512 < entry->size || entry->statx_buf.stx_nlink > 1
+                    || (pipeline.readers > 0 && entry->size > PIPELINE_BUFFER_SIZE)) {
+                    uring_hand_off(entry);
+                    queued = NOT_SUPPORTED;
+                    break;
+                }
+                queued = uring_queue_open(ring, slot, URING_OP_OPEN_DEST, entry->dest_dirfd, entry->dest_name,
+                                          O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, options.metadata ? S_IRUSR | S_IWUSR : entry->mode & 07777);
+                break;
+            case URING_OP_OPEN_DEST: {
+                // A clone is a single metadata operation, so it is tried in
+                // place and only files the filesystem refuses go through reads
+                int cloned = clone_file(entry->src_fd, entry->dest_fd, entry->entry);
+                if (NO_ERROR == cloned) {
+                    STATS_ADD(bytes, entry->size);
+                    entry->cloned = 1;
+                    entry->offset = entry->size;
+                    queued = NOT_SUPPORTED;
+                    break;
+                }
+                if (ERROR == cloned) {
+                    entry->failed = 1;
+                    queued = NOT_SUPPORTED;
+                    break;
+                }
+                entry->stage = URING_OP_READ;
+            }
+            /* fall through */
+            default:
+                if (entry->offset >= entry->size) {
+                    queued = NOT_SUPPORTED;
+                    break;
+                }
+                queued = uring_queue_io(ring, slot, entry->written < entry->length ? URING_OP_WRITE : URING_OP_READ);
+                break;
+        }
+        if (NO_ERROR == queued) {
+            return;
+        }
+        if (ERROR == queued) {
+            uring_fail_slot(entry, SIDE_DEST, EBUSY);
+        }
+    }
+
+    if (!entry->failed && options.metadata && ERROR != entry->dest_fd) {
+        uring_apply_metadata(entry);
+    }
+    uring_queue_close(ring, slot);
+    if (0 == entry->pending_ops) {
+        uring_finish_slot(ring, slot);
+    }
+}
+
+void uring_complete(uring_t *ring, struct io_uring_cqe *cqe) {
+    int slot = (int)(cqe->user_data >> 8);
+    int op = (int)(cqe->user_data & 0xff);
+    uring_slot_t *entry = &ring->slots[slot];
+    int res = cqe->res;
+    entry->pending_ops--;
+
+    switch (op) {
+        case URING_OP_OPEN_SRC:
+            if (res < 0) {
+                uring_fail_slot(entry, SIDE_SRC, -res);
+            }
+            else {
+                entry->src_fd = res;
+            }
+            break;
+        case URING_OP_STATX:
+            if (res < 0) {
+                uring_fail_slot(entry, SIDE_SRC, -res);
+            }
+            else {
+                entry->size = (off_t)entry->statx_buf.stx_size;
+                entry->mode = entry->statx_buf.stx_mode;
+            }
+            break;
+        case URING_OP_OPEN_DEST:
+            if (res < 0) {
+                uring_fail_slot(entry, SIDE_DEST, -res);
+            }
+            else {
+                entry->dest_fd = res;
+            }
+            break;
+        case URING_OP_READ:
+            if (res < 0) {
+                uring_fail_slot(entry, SIDE_SRC, -res);
+            }
+            else if (0 == res) {
+                entry->size = entry->offset;
+            }
+            else {
+                entry->length = (unsigned int)res;
+                entry->written = 0;
+                if (NULL != options.manifest_path) {
+                    entry->crc = crc32c_update(entry->crc, entry->buffer, res);
+                }
+            }
+            break;
+        case URING_OP_WRITE:
+            if (res <= 0) {
+                uring_fail_slot(entry, SIDE_DEST, res < 0 ? -res : EIO);
+                break;
+            }
+            entry->written += (unsigned int)res;
+            STATS_ADD(bytes, res);
+            if (entry->written == entry->length) {
+                entry->offset += entry->length;
+                entry->length = 0;
+                entry->written = 0;
+            }
+            break;
+        default:
+            if (res < 0) {
+                uring_fail_slot(entry, SIDE_DEST, -res);
+            }
+            break;
+    }
+    uring_advance(ring, slot);
+}
+
+// The head is reread for every completion because finishing a file can
+// block in fd_acquire, which reaps this ring again before returning
+int uring_reap(uring_t *ring) {
+    int reaped = 0;
+    unsigned int head;
+    while ((head = *ring->cq_head) != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        uring_complete(ring, &cqe);
+        reaped++;
+    }
+    return reaped;
+}
+
+void uring_wait(uring_t *ring) {
+    if (NO_ERROR != uring_submit(ring, uring_reap(ring) > 0 ? 0 : 1)) {
+        return;
+    }
+    uring_reap(ring);
+}
+
+int uring_is_busy(uring_t *ring) {
+    return NULL != ring && ring->active > 0;
+}
+
+void uring_drain(uring_t *ring) {
+    while (uring_is_busy(ring)) {
+        uring_wait(ring);
+    }
+}
+
+int uring_copy_file(uring_t *ring, entry_t *file) {
+    while (URING_SLOTS == ring->active) {
+        uring_wait(ring);
+    }
+    while (NO_ERROR != fd_try_acquire(2)) {
+        if (0 == ring->active) {
+            fd_acquire(2);
+            break;
+        }
+        uring_wait(ring);
+    }
+
+    int slot = 0;
+    while (NULL != ring->slots[slot].entry) {
+        slot++;
+    }
+
+    uring_slot_t *entry = &ring->slots[slot];
+    memset(entry, 0, offsetof(uring_slot_t, buffer));
+    entry->entry = file;
+    entry->src_fd = ERROR;
+    entry->dest_fd = ERROR;
+    entry->started = now_usec();
+    entry->dest_dirfd = entry_anchor(file, SIDE_DEST, &entry->dest_name);
+    if (entry->dest_name != file->name) {
+        entry->dest_name_copy = strdup(entry->dest_name);
+        entry->dest_name = entry->dest_name_copy;
+    }
+    ring->active++;
+    pool_hold(&copy_pool);
+
+    const char *src_name;
+    int src_dirfd = entry_anchor(file, SIDE_SRC, &src_name);
+    if (NULL == entry->dest_name) {
+        entry->failed = 1;
+        uring_advance(ring, slot);
+        return NO_ERROR;
+    }
+    if (ERROR == uring_queue_open(ring, slot, URING_OP_OPEN_SRC, src_dirfd, src_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0)) {
+        uring_fail_slot(entry, SIDE_SRC, EBUSY);
+        uring_advance(ring, slot);
+        return NO_ERROR;
+    }
+    uring_submit(ring, 0);
+    uring_reap(ring);
+    return NO_ERROR;
+}
+
+#else
+
+typedef struct uring {
+    int active;
+} uring_t;
+
+uring_t *uring_create(void) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_destroy(uring_t *ring) {
+    (void)ring;
+}
+
+int uring_is_busy(uring_t *ring) {
+    (void)ring;
+    return 0;
+}
+
+void uring_wait(uring_t *ring) {
+    (void)ring;
+}
+
+void uring_drain(uring_t *ring) {
+    (void)ring;
+}
+
+int uring_copy_file(uring_t *ring, entry_t *file) {
+    (void)ring;
+    (void)file;
+    return ERROR;
+}
+
+#endif
+
+uring_t *get_worker_ring(void) {
+    worker_t *worker = current_worker;
+    if (!options.uring || options.sync || NULL != options.archive_path || NULL == worker || atomic_load(&uring_unavailable)) {
+        return NULL;
+    }
+    if (NULL == worker->ring) {
+        worker->ring = uring_create();
+        if (NULL == worker->ring && 0 == atomic_exchange(&uring_unavailable, 1)) {
+            print_error("io_uring unavailable, using blocking copy", errno);
+        }
+    }
+    return worker->ring;
+}
+
+int clone_file(int src_fd, int dest_fd, const entry_t *entry) {
+    if (REFLINK_NEVER == options.reflink || (REFLINK_AUTO == options.reflink && atomic_load(&reflink_refused))
+        || NULL != options.manifest_path) {
+        return NOT_SUPPORTED;
+    }
+    STATS_ADD(syscalls, 1);
+    if (NO_ERROR == ioctl(dest_fd, FICLONE, src_fd)) {
+        if (options.verbose) {
+            printf("%s -> %s: reflink\n", entry_path(entry, SIDE_SRC), entry_path(entry, SIDE_DEST));
+        }
+        return NO_ERROR;
+    }
+
+    int code = errno;
+    if (REFLINK_ALWAYS == options.reflink) {
+        print_error(entry_path(entry, SIDE_DEST), code);
+        return ERROR;
+    }
+    if (ENOTTY == code || EOPNOTSUPP == code || ENOSYS == code) {
+        atomic_store(&reflink_refused, 1);
+    }
+    return NOT_SUPPORTED;
+}
+
+void inode_map_init(void) {
+    for (int i = 0; i < INODE_MAP_SHARDS; i++) {
+        pthread_mutex_init(&inode_map[i].mutex, NULL);
+    }
+}
+
+void inode_map_destroy(void) {
+    for (int i = 0; i < INODE_MAP_SHARDS; i++) {
+        inode_shard_t *shard = &inode_map[i];
+        for (size_t j = 0; j < shard->bucket_count; j++) {
+            while (NULL != shard->buckets[j]) {
+                inode_link_t *link = shard->buckets[j];
+                shard->buckets[j] = link->next;
+                while (NULL != link->waiters) {
+                    inode_waiter_t *waiter = link->waiters;
+                    link->waiters = waiter->next;
+                    free(waiter);
+                }
+                free(link);
+            }
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+}
+
+size_t inode_hash(dev_t dev, ino_t ino) {
+    return (size_t)(((uint64_t)dev * HASH_PRIME) ^ ((uint64_t)ino * HASH_PRIME >> 7));
+}
+
+int inode_shard_grow(inode_shard_t *shard) {
+    size_t bucket_count = 0 == shard->bucket_count ? INODE_MAP_INITIAL_BUCKETS : shard->bucket_count * 2;
+    inode_link_t **buckets = calloc(bucket_count, sizeof(inode_link_t *));
+    if (NULL == buckets) {
+        return ERROR;
+    }
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        while (NULL != shard->buckets[i]) {
+            inode_link_t *link = shard->buckets[i];
+            shard->buckets[i] = link->next;
+            size_t bucket = inode_hash(link->dev, link->ino) / INODE_MAP_SHARDS % bucket_count;
+            link->next = buckets[bucket];
+            buckets[bucket] = link;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = bucket_count;
+    return NO_ERROR;
+}
+
+// Finds the destination already written for this inode. The first entry
+// to see an inode becomes its owner and copies it (NOT_SUPPORTED); later
+// ones wait behind the owner (HANDED_OFF) until its copy is committed, so
+// nothing links to a file that may still fail and be removed
+int inode_map_claim(const struct stat *stat_buf, entry_t *entry, const char *path, inode_link_t **result) {
+    size_t hash = inode_hash(stat_buf->st_dev, stat_buf->st_ino);
+    inode_shard_t *shard = &inode_map[hash % INODE_MAP_SHARDS];
+    pthread_mutex_lock(&shard->mutex);
+
+    if (0 != shard->bucket_count) {
+        inode_link_t *link = shard->buckets[hash / INODE_MAP_SHARDS % shard->bucket_count];
+        for (; NULL != link; link = link->next) {
+            if (link->dev != stat_buf->st_dev || link->ino != stat_buf->st_ino) {
+                continue;
+            }
+            int status = NO_ERROR;
+            if (NULL != link->owner) {
+                inode_waiter_t *waiter = malloc(sizeof(inode_waiter_t));
+                status = NOT_SUPPORTED;
+                if (NULL != waiter) {
+                    waiter->entry = entry;
+                    waiter->next = link->waiters;
+                    link->waiters = waiter;
+                    status = HANDED_OFF;
+                }
+            }
+            pthread_mutex_unlock(&shard->mutex);
+            *result = link;
+            return status;
+        }
+    }
+
+    if (shard->size >= shard->bucket_count * 2 && ERROR == inode_shard_grow(shard)) {
+        pthread_mutex_unlock(&shard->mutex);
+        return NOT_SUPPORTED;
+    }
+    size_t path_length = strlen(path);
+    inode_link_t *link = malloc(sizeof(inode_link_t) + path_length + 1);
+    if (NULL != link) {
+        link->dev = stat_buf->st_dev;
+        link->ino = stat_buf->st_ino;
+        link->owner = entry;
+        link->waiters = NULL;
+        memcpy(link->path, path, path_length + 1);
+        size_t bucket = hash / INODE_MAP_SHARDS % shard->bucket_count;
+        link->next = shard->buckets[bucket];
+        shard->buckets[bucket] = link;
+        shard->size++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return NOT_SUPPORTED;
+}
+
+// Called by the owner of an inode once its copy is committed or abandoned.
+// Entries queued behind it are copied again: they link to the committed
+// file, or after a failure one of them claims the inode afresh.
+void inode_map_settle(const entry_t *entry, const struct stat *stat_buf, int result) {
+    if (stat_buf->st_nlink <= 1) {
+        return;
+    }
+    size_t hash = inode_hash(stat_buf->st_dev, stat_buf->st_ino);
+    inode_shard_t *shard = &inode_map[hash % INODE_MAP_SHARDS];
+    inode_waiter_t *waiters = NULL;
+    pthread_mutex_lock(&shard->mutex);
+    if (0 != shard->bucket_count) {
+        inode_link_t **link = &shard->buckets[hash / INODE_MAP_SHARDS % shard->bucket_count];
+        while (NULL != *link && ((*link)->dev != stat_buf->st_dev || (*link)->ino != stat_buf->st_ino)) {
+            link = &(*link)->next;
+        }
+        if (NULL != *link && entry == (*link)->owner) {
+            inode_link_t *settled = *link;
+            waiters = settled->waiters;
+            settled->waiters = NULL;
+            settled->owner = NULL;
+            if (NO_ERROR != result) {
+                *link = settled->next;
+                shard->size--;
+                free(settled);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    while (NULL != waiters) {
+        inode_waiter_t *waiter = waiters;
+        waiters = waiter->next;
+        if (NO_ERROR != pool_submit(&copy_pool, copy_file_blocking, waiter->entry)) {
+            copy_file_blocking(waiter->entry);
+        }
+        free(waiter);
+    }
+}
+
+int link_duplicate(entry_t *entry, const struct stat *stat_buf, const char *temp_name) {
+    const char *name;
+    int dirfd = entry_anchor(entry, SIDE_DEST, &name);
+    char *path = entry_path(entry, SIDE_DEST);
+    if (NULL == path) {
+        return NOT_SUPPORTED;
+    }
+    inode_link_t *link = NULL;
+    int claimed = inode_map_claim(stat_buf, entry, path, &link);
+    if (NO_ERROR != claimed) {
+        return claimed;
+    }
+
+    STATS_ADD(syscalls, 1);
+    if (ERROR == linkat(AT_FDCWD, link->path, dirfd, NULL == temp_name ? name : temp_name, 0)) {
+        if (ENOENT == errno || EXDEV == errno || EMLINK == errno || EPERM == errno) {
+            return NOT_SUPPORTED;
+        }
+        perror(path);
+        return ERROR;
+    }
+
+    STATS_ADD(links, 1);
+    if (NULL != options.manifest_path) {
+        manifest_add_link(entry, link->path);
+    }
+    if (options.verbose) {
+        printf("%s -> %s: hard link to %s\n", entry_path(entry, SIDE_SRC), path, link->path);
+    }
+    if (NULL != temp_name) {
+        return commit_temp_file(entry, temp_name, stat_buf, 0);
+    }
+    return NO_ERROR;
+}
+
+int tar_octal(char *field, size_t width, unsigned long long value) {
+    char digits[32];
+    int length = snprintf(digits, sizeof(digits), "%0*llo", (int)width - 1, value);
+    if ((size_t)length >= width) {
+        return ERROR;
+    }
+    memcpy(field, digits, length + 1);
+    return NO_ERROR;
+}
+
+void tar_checksum(tar_header_t *header) {
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    const unsigned char *bytes = (const unsigned char *)header;
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(tar_header_t); i++) {
+        sum += bytes[i];
+    }
+    snprintf(header->checksum, sizeof(header->checksum), "%06o", sum);
+    header->checksum[sizeof(header->checksum) - 1] = ' ';
+}
+
+void tar_init_header(tar_header_t *header, char type, mode_t mode, off_t size, time_t mtime) {
+    memset(header, 0, sizeof(tar_header_t));
+    tar_octal(header->mode, sizeof(header->mode), mode & 07777);
+    tar_octal(header->uid, sizeof(header->uid), 0);
+    tar_octal(header->gid, sizeof(header->gid), 0);
+    tar_octal(header->size, sizeof(header->size), size);
+    tar_octal(header->mtime, sizeof(header->mtime), mtime > 0 ? mtime : 0);
+    header->type = type;
+    memcpy(header->magic, "ustar", sizeof(header->magic));
+    memcpy(header->version, "00", sizeof(header->version));
+}
+
+int tar_set_name(tar_header_t *header, const char *name) {
+    size_t length = strlen(name);
+    if (length <= sizeof(header->name)) {
+        memcpy(header->name, name, length);
+        return NO_ERROR;
+    }
+    for (const char *slash = strchr(name, '/'); NULL != slash; slash = strchr(slash + 1, '/')) {
+        size_t prefix_length = (size_t)(slash - name);
+        if (prefix_length > sizeof(header->prefix)) {
+            break;
+        }
+        // A split on the trailing slash of a directory would leave name empty
+        if (prefix_length + 1 < length && length - prefix_length - 1 <= sizeof(header->name)) {
+            memcpy(header->prefix, name, prefix_length);
+            memcpy(header->name, slash + 1, length - prefix_length - 1);
+            return NO_ERROR;
+        }
+    }
+    memcpy(header->name, name, sizeof(header->name));
+    return ERROR;
+}
+
+void pax_add(pax_buffer_t *pax, const char *key, const char *value, size_t value_length) {
+    size_t base = strlen(key) + value_length + 3;
+    size_t length = base + 1;
+    while ((size_t)snprintf(NULL, 0, "%zu", length) != length - base) {
+        length++;
+    }
+    if (pax->length + length > pax->capacity) {
+        size_t capacity = 0 == pax->capacity ? TAR_BLOCK_SIZE : pax->capacity;
+        while (pax->length + length > capacity) {
+            capacity *= 2;
+        }
+        char *grown = realloc(pax->data, capacity);
+        if (NULL == grown) {
+            pax->failed = 1;
+            return;
+        }
+        pax->data = grown;
+        pax->capacity = capacity;
+    }
+    char *record = pax->data + pax->length;
+    int prefix_length = sprintf(record, "%zu %s=", length, key);
+    memcpy(record + prefix_length, value, value_length);
+    record[length - 1] = '\n';
+    pax->length += length;
+}
+
+void pax_add_number(pax_buffer_t *pax, const char *key, long long value) {
+    char digits[32];
+    pax_add(pax, key, digits, snprintf(digits, sizeof(digits), "%lld", value));
+}
+
+void pax_add_time(pax_buffer_t *pax, const char *key, const struct timespec *time) {
+    char digits[48];
+    pax_add(pax, key, digits, snprintf(digits, sizeof(digits), "%lld.%09ld", (long long)time->tv_sec, time->tv_nsec));
+}
+
+int pax_add_xattr(void *context, const char *name, const char *value, size_t size) {
+    char key[XATTR_NAME_MAX + sizeof("SCHILY.xattr.")];
+    snprintf(key, sizeof(key), "SCHILY.xattr.%s", name);
+    pax_add((pax_buffer_t *)context, key, value, size);
+    return NO_ERROR;
+}
+
+char *archive_build_header(const char *name, const struct stat *stat_buf, char type, const char *target, int src_fd, size_t reserve, size_t *length) {
+    off_t size = '0' == type ? stat_buf->st_size : 0;
+    tar_header_t header;
+    tar_init_header(&header, type, stat_buf->st_mode, size, stat_buf->st_mtim.tv_sec);
+    pax_buffer_t pax = { NULL, 0, 0, 0 };
+
+    if (ERROR == tar_set_name(&header, name)) {
+        pax_add(&pax, "path", name, strlen(name));
+    }
+    if (NULL != target) {
+        size_t target_length = strlen(target);
+        memcpy(header.linkname, target, target_length < sizeof(header.linkname) ? target_length : sizeof(header.linkname));
+        if (target_length > sizeof(header.linkname)) {
+            pax_add(&pax, "linkpath", target, target_length);
+        }
+    }
+    if (ERROR == tar_octal(header.uid, sizeof(header.uid), stat_buf->st_uid)) {
+        pax_add_number(&pax, "uid", stat_buf->st_uid);
+    }
+    if (ERROR == tar_octal(header.gid, sizeof(header.gid), stat_buf->st_gid)) {
+        pax_add_number(&pax, "gid", stat_buf->st_gid);
+    }
+    if (ERROR == tar_octal(header.size, sizeof(header.size), size)) {
+        pax_add_number(&pax, "size", size);
+    }
+    if (S_ISCHR(stat_buf->st_mode) || S_ISBLK(stat_buf->st_mode)) {
+        tar_octal(header.devmajor, sizeof(header.devmajor), major(stat_buf->st_rdev));
+        tar_octal(header.devminor, sizeof(header.devminor), minor(stat_buf->st_rdev));
+    }
+    if (options.metadata) {
+        pax_add_time(&pax, "atime", &stat_buf->st_atim);
+        pax_add_time(&pax, "mtime", &stat_buf->st_mtim);
+        if (ERROR != src_fd && ERROR == for_each_xattr(src_fd, name, pax_add_xattr, &pax)) {
+            pax.failed = 1;
+        }
+    }
+    tar_checksum(&header);
+
+    size_t pax_size = 0 == pax.length ? 0 : TAR_BLOCK_SIZE + ALIGN_UP(pax.length, TAR_BLOCK_SIZE);
+    *length = pax_size + TAR_BLOCK_SIZE;
+    char *data = pax.failed ? NULL : calloc(1, *length + reserve);
+    if (NULL != data && 0 != pax.length) {
+        const char *base = strrchr(name, '/');
+        base = NULL == base || '\0' == base[1] ? name : base + 1;
+        tar_header_t pax_header;
+        tar_init_header(&pax_header, 'x', S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH, pax.length, stat_buf->st_mtim.tv_sec);
+        snprintf(pax_header.name, sizeof(pax_header.name), TAR_PAX_NAME "%.*s",
+                 (int)(sizeof(pax_header.name) - sizeof(TAR_PAX_NAME)), base);
+        tar_checksum(&pax_header);
+        memcpy(data, &pax_header, TAR_BLOCK_SIZE);
+        memcpy(data + TAR_BLOCK_SIZE, pax.data, pax.length);
+    }
+    if (NULL != data) {
+        memcpy(data + pax_size, &header, TAR_BLOCK_SIZE);
+    }
+    free(pax.data);
+    return data;
+}
+
+char *archive_name(const entry_t *entry, int directory) {
+    const char *path = entry_path(entry, SIDE_SRC) + root_lengths[SIDE_SRC];
+    while ('/' == *path) {
+        path++;
+    }
+    if ('\0' == *path) {
+        return "./";
+    }
+    size_t length = strlen(path);
+    char *name = arena_alloc(length + 2);
+    if (NULL != name) {
+        memcpy(name, path, length);
+        name[length] = '/';
+        name[directory ? length + 1 : length] = '\0';
+    }
+    return name;
+}
+
+int archive_write(const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_written = write(archive.fd, buffer, length);
+        STATS_ADD(syscalls, 1);
+        if (ERROR == bytes_written) {
+            if (EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            return ERROR;
+        }
+        buffer += bytes_written;
+        length -= bytes_written;
+    }
+    return NO_ERROR;
+}
+
+int archive_write_zeros(off_t length) {
+    static const char zeros[TAR_BLOCK_SIZE];
+    while (length > 0) {
+        size_t chunk = length > TAR_BLOCK_SIZE ? TAR_BLOCK_SIZE : (size_t)length;
+        if (ERROR == archive_write(zeros, chunk)) {
+            return ERROR;
+        }
+        length -= chunk;
+    }
+    return NO_ERROR;
+}
+
+int archive_stream_file(archive_record_t *record, char **buffer, int *file_failed) {
+    off_t done = 0;
+    int use_sendfile = 1;
+    while (done < record->size) {
+        size_t length = record->size - done > MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE : (size_t)(record->size - done);
+        ssize_t copied;
+        if (use_sendfile) {
+            off_t offset = done;
+            copied = sendfile(archive.fd, record->src_fd, &offset, length);
+            STATS_ADD(syscalls, 1);
+            if (ERROR == copied && EINTR != errno) {
+                use_sendfile = 0;
+                continue;
+            }
+        }
+        else {
+            if (NULL == *buffer && NULL == (*buffer = malloc(ARCHIVE_BUFFER_SIZE))) {
+                return ERROR;
+            }
+            copied = pread(record->src_fd, *buffer, length > ARCHIVE_BUFFER_SIZE ? ARCHIVE_BUFFER_SIZE : length, done);
+            STATS_ADD(syscalls, 1);
+            if (ERROR == copied && EINTR != errno) {
+                perror(entry_path(record->entry, SIDE_SRC));
+                *file_failed = 1;
+                break;
+            }
+            if (copied > 0 && ERROR == archive_write(*buffer, copied)) {
+                return ERROR;
+            }
+        }
+        if (ERROR == copied) {
+            STATS_ADD(retries, 1);
+            continue;
+        }
+        if (0 == copied) {
+            fprintf(stderr, "%s: file shrank while archiving\n", entry_path(record->entry, SIDE_SRC));
+            *file_failed = 1;
+            break;
+        }
+        done += copied;
+        STATS_ADD(bytes, copied);
+    }
+    return archive_write_zeros(ALIGN_UP(record->size, TAR_BLOCK_SIZE) - done);
+}
+
+void *archive_writer(void *param) {
+    (void)param;
+    char *buffer = NULL;
+    pthread_mutex_lock(&archive.mutex);
+    while (1) {
+        while (!archive.shutdown && NULL == archive.head) {
+            pthread_cond_wait(&archive.write_cond, &archive.mutex);
+        }
+        archive_record_t *record = archive.head;
+        if (NULL == record) {
+            break;
+        }
+        archive.head = record->next;
+        if (NULL == archive.head) {
+            archive.tail = NULL;
+        }
+        int failed = 0 != archive.error;
+        pthread_mutex_unlock(&archive.mutex);
+
+        int result = failed ? ERROR : archive_write(record->data, record->length);
+        int file_failed = 0;
+        if (NO_ERROR == result && ERROR != record->src_fd) {
+            result = archive_stream_file(record, &buffer, &file_failed);
+        }
+        int code = errno;
+        if (ERROR != record->src_fd) {
+            close_source_file(record->src_fd, record->entry);
+            stats_file_done(record->started, record->size, NO_ERROR == result && !file_failed ? NO_ERROR : ERROR);
+            entry_done(record->entry);
+            arena_reset();
+            pool_release(&copy_pool);
+        }
+
+        pthread_mutex_lock(&archive.mutex);
+        if (ERROR == result && !failed) {
+            archive.error = code;
+            print_error(options.archive_path, code);
+        }
+        archive.queued -= record->length;
+        pthread_cond_broadcast(&archive.space_cond);
+        free(record->data);
+        free(record);
+    }
+    pthread_mutex_unlock(&archive.mutex);
+    free(buffer);
+    arena_destroy();
+    return NULL;
+}
+
+int archive_enqueue(archive_record_t *record) {
+    pthread_mutex_lock(&archive.mutex);
+    while (0 == archive.error && archive.queued > ARCHIVE_QUEUE_MAX) {
+        pthread_cond_wait(&archive.space_cond, &archive.mutex);
+    }
+    int code = archive.error;
+    if (0 == code) {
+        record->next = NULL;
+        if (NULL == archive.tail) {
+            archive.head = record;
+        }
+        else {
+            archive.tail->next = record;
+        }
+        archive.tail = record;
+        archive.queued += record->length;
+        pthread_cond_signal(&archive.write_cond);
+    }
+    pthread_mutex_unlock(&archive.mutex);
+    if (0 != code) {
+        errno = code;
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
+archive_record_t *archive_create_record(const char *name, const struct stat *stat_buf, char type, const char *target, int src_fd, size_t reserve) {
+    archive_record_t *record = NULL == name ? NULL : calloc(1, sizeof(archive_record_t));
+    if (NULL == record) {
+        return NULL;
+    }
+    record->data = archive_build_header(name, stat_buf, type, target, src_fd, reserve, &record->length);
+    if (NULL == record->data) {
+        free(record);
+        return NULL;
+    }
+    record->src_fd = ERROR;
+    return record;
+}
+
+int archive_add_header(const entry_t *entry, const struct stat *stat_buf, char type, const char *target, int src_fd) {
+    archive_record_t *record = archive_create_record(archive_name(entry, '5' == type), stat_buf, type, target, src_fd, 0);
+    if (NULL == record) {
+        perror(entry_path(entry, SIDE_SRC));
+        return ERROR;
+    }
+    if (ERROR == archive_enqueue(record)) {
+        free(record->data);
+        free(record);
+        return ERROR;
+    }
+    if (options.verbose) {
+        printf("%s -> %s: archived\n", entry_path(entry, SIDE_SRC), options.archive_path);
+    }
+    return NO_ERROR;
+}
+
+int archive_add_directory(const entry_t *entry, const struct stat *stat_buf, int src_fd) {
+    return archive_add_header(entry, stat_buf, '5', NULL, src_fd);
+}
+
+int archive_add_special(const entry_t *entry, const struct stat *stat_buf, const char *target) {
+    char type = S_ISLNK(stat_buf->st_mode) ? '2'
+              : S_ISCHR(stat_buf->st_mode) ? '3'
+              : S_ISBLK(stat_buf->st_mode) ? '4'
+              : S_ISFIFO(stat_buf->st_mode) ? '6' : '\0';
+    if ('\0' == type) {
+        fprintf(stderr, "%s: socket ignored\n", entry_path(entry, SIDE_SRC));
+        return NO_ERROR;
+    }
+    return archive_add_header(entry, stat_buf, type, target, ERROR);
+}
+
+int archive_add_file(entry_t *entry, long long started, off_t *size) {
+    int src_fd;
+    struct stat stat_buf;
+    if (ERROR == open_source_file(entry, &stat_buf, &src_fd)) {
+        return ERROR;
+    }
+    *size = stat_buf.st_size;
+
+    // The first sighting of an inode stores its data; later ones become
+    // tar hard-link entries naming that member, queued after its record
+    char *name = archive_name(entry, 0);
+    if (stat_buf.st_nlink > 1 && NULL != name) {
+        inode_link_t *link = NULL;
+        int claimed = inode_map_claim(&stat_buf, entry, name, &link);
+        if (NOT_SUPPORTED != claimed) {
+            close_source_file(src_fd, entry);
+            if (HANDED_OFF == claimed) {
+                return HANDED_OFF;
+            }
+            if (ERROR == archive_add_header(entry, &stat_buf, '1', link->path, ERROR)) {
+                return ERROR;
+            }
+            STATS_ADD(links, 1);
+            return NO_ERROR;
+        }
+    }
+
+    int inline_data = stat_buf.st_size <= ARCHIVE_INLINE_MAX;
+    size_t reserve = inline_data ? ALIGN_UP(stat_buf.st_size, TAR_BLOCK_SIZE) : 0;
+    archive_record_t *record = archive_create_record(name, &stat_buf, '0', NULL, src_fd, reserve);
+    if (NULL == record) {
+        perror(entry_path(entry, SIDE_SRC));
+        close_source_file(src_fd, entry);
+        inode_map_settle(entry, &stat_buf, ERROR);
+        return ERROR;
+    }
+
+    int result = NO_ERROR;
+    if (inline_data) {
+        char *data = record->data + record->length;
+        off_t done = 0;
+        while (done < stat_buf.st_size) {
+            ssize_t bytes_read = pread(src_fd, data + done, stat_buf.st_size - done, done);
+            STATS_ADD(syscalls, 1);
+            if (ERROR == bytes_read && EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            if (ERROR == bytes_read) {
+                perror(entry_path(entry, SIDE_SRC));
+                result = ERROR;
+                break;
+            }
+            if (0 == bytes_read) {
+                fprintf(stderr, "%s: file shrank while archiving\n", entry_path(entry, SIDE_SRC));
+                result = ERROR;
+                break;
+            }
+            done += bytes_read;
+        }
+        record->length += reserve;
+        STATS_ADD(bytes, done);
+        close_source_file(src_fd, entry);
+    }
+    else {
+        record->entry = entry;
+        record->src_fd = src_fd;
+        record->size = stat_buf.st_size;
+        record->started = started;
+        pool_hold(&copy_pool);
+    }
+
+    if (ERROR == archive_enqueue(record)) {
+        if (!inline_data) {
+            pool_release(&copy_pool);
+            close_source_file(src_fd, entry);
+        }
+        free(record->data);
+        free(record);
+        inode_map_settle(entry, &stat_buf, ERROR);
+        return ERROR;
+    }
+    inode_map_settle(entry, &stat_buf, inline_data ? result : NO_ERROR);
+    if (options.verbose) {
+        printf("%s -> %s: archived\n", entry_path(entry, SIDE_SRC), options.archive_path);
+    }
+    return inline_data ? result : HANDED_OFF;
+}
+
+int archive_init(const char *path) {
+    archive.fd = STRINGS_EQUAL(path, "-") ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (ERROR == archive.fd) {
+        perror(path);
+        return ERROR;
+    }
+    int errorCode = pthread_create(&archive.thread, NULL, archive_writer, NULL);
+    if (NO_ERROR != errorCode) {
+        print_error("Unable to create thread", errorCode);
+        if (STDOUT_FILENO != archive.fd) {
+            close(archive.fd);
+        }
+        return ERROR;
+    }
+    archive.running = 1;
+    return NO_ERROR;
+}
+
+int archive_finish(void) {
+    pthread_mutex_lock(&archive.mutex);
+    archive.shutdown = 1;
+    pthread_cond_broadcast(&archive.write_cond);
+    pthread_mutex_unlock(&archive.mutex);
+    int errorCode = pthread_join(archive.thread, NULL);
+    if (NO_ERROR != errorCode) {
+        print_error("Unable to join thread", errorCode);
+    }
+    archive.running = 0;
+
+    int result = 0 == archive.error ? archive_write_zeros(2 * TAR_BLOCK_SIZE) : ERROR;
+    if (ERROR == result && 0 == archive.error) {
+        perror(options.archive_path);
+    }
+    if (STDOUT_FILENO != archive.fd && ERROR == close(archive.fd)) {
+        perror(options.archive_path);
+        result = ERROR;
+    }
+    return result;
+}
+
+int copy_file_data(entry_t *entry, const char *temp_name, int src_fd, const struct stat *stat_buf, long long started) {
+    int dest_fd;
+    int result;
+    mode_t mode = options.metadata ? S_IRUSR | S_IWUSR : stat_buf->st_mode;
+    if (ERROR == open_dest_file(entry, temp_name, O_WRONLY | O_CREAT | O_EXCL, mode, src_fd, &dest_fd)) {
+        return ERROR;
+    }
+
+    result = clone_file(src_fd, dest_fd, entry);
+    if (NOT_SUPPORTED != result) {
+        if (NO_ERROR == result) {
+            STATS_ADD(bytes, stat_buf->st_size);
+        }
+        if (NO_ERROR == result && options.metadata) {
+            result = apply_entry_metadata(src_fd, dest_fd, stat_buf, entry);
+        }
+        close_file_pair(src_fd, dest_fd, entry);
+        if (NULL != temp_name) {
+            result = commit_temp_file(entry, temp_name, stat_buf, ERROR == result);
+        }
+        return result;
+    }
+
+    if (is_pipelined_file(dest_fd, stat_buf)
+        && HANDED_OFF == pipeline_submit(src_fd, dest_fd, stat_buf, entry, temp_name, started)) {
+        return HANDED_OFF;
+    }
+
+    if (is_chunked_file(stat_buf->st_size)) {
+        result = copy_file_chunked(dest_fd, stat_buf, entry, temp_name, started);
+        close_file_pair(src_fd, dest_fd, entry);
+        if (ERROR == result) {
+            discard_chunked_file(entry, temp_name);
+        }
+        return result;
+    }
+
+    uint32_t crc = 0;
+    result = copy_file_content(src_fd, dest_fd, stat_buf, entry, NULL != options.manifest_path ? &crc : NULL);
+    if (NO_ERROR == result && options.metadata) {
+        result = apply_entry_metadata(src_fd, dest_fd, stat_buf, entry);
+    }
+    close_file_pair(src_fd, dest_fd, entry);
+    if (NULL != temp_name) {
+        result = commit_temp_file(entry, temp_name, stat_buf, ERROR == result);
+    }
+    if (NO_ERROR == result && NULL != options.manifest_path) {
+        manifest_add(entry, stat_buf->st_size, crc);
+    }
+    return result;
+}
+
+int copy_regular_file(entry_t *entry, long long started, off_t *size) {
+    if (NULL == entry) {
+        fprintf(stderr, "copy_regular_file: invalid entry\n");
+        return ERROR;
+    }
+    if (NULL != options.archive_path) {
+        return archive_add_file(entry, started, size);
+    }
+
+    char *temp_name = NULL;
+    if (options.sync) {
+        if (is_unchanged(entry)) {
+            if (options.verbose) {
+                printf("%s -> %s: unchanged\n", entry_path(entry, SIDE_SRC), entry_path(entry, SIDE_DEST));
+            }
+            if (NULL != options.manifest_path) {
+                manifest_add_existing(entry);
+            }
+            return NO_ERROR;
+        }
+        temp_name = make_temp_name(entry);
+        if (NULL == temp_name) {
+            return ERROR;
+        }
+    }
+
+    int src_fd;
+    struct stat stat_buf;
+    if (ERROR == open_source_file(entry, &stat_buf, &src_fd)) {
+        return ERROR;
+    }
+    *size = stat_buf.st_size;
+
+    int result;
+    if (stat_buf.st_nlink > 1 && NOT_SUPPORTED != (result = link_duplicate(entry, &stat_buf, temp_name))) {
+        close_source_file(src_fd, entry);
+        return result;
+    }
+    result = copy_file_data(entry, temp_name, src_fd, &stat_buf, started);
+    if (HANDED_OFF != result) {
+        inode_map_settle(entry, &stat_buf, result);
+    }
+    return result;
+}
+
+void copy_file_blocking(void *param) {
+    entry_t *entry = (entry_t *)param;
+    long long started = now_usec();
+    off_t size = 0;
+    int result = copy_regular_file(entry, started, &size);
+    if (HANDED_OFF != result) {
+        stats_file_done(started, size, result);
+        entry_done(entry);
+    }
+}
+
+void copy_file_entry(entry_t *entry) {
+    uring_t *ring = get_worker_ring();
+    if (NULL != ring && NO_ERROR == uring_copy_file(ring, entry)) {
+        return;
+    }
+    copy_file_blocking(entry);
+}
+
+void schedule_add(entry_t *entry, off_t size) {
+    pthread_mutex_lock(&schedule.mutex);
+    if (schedule.count == schedule.capacity) {
+        size_t capacity = 0 == schedule.capacity ? SCHEDULE_INITIAL_CAPACITY : schedule.capacity * 2;
+        scheduled_file_t *grown = realloc(schedule.files, capacity * sizeof(scheduled_file_t));
+        if (NULL == grown) {
+            pthread_mutex_unlock(&schedule.mutex);
+            copy_file_entry(entry);
+            return;
+        }
+        schedule.files = grown;
+        schedule.capacity = capacity;
+    }
+    schedule.files[schedule.count].entry = entry;
+    schedule.files[schedule.count].cost = size + SCHEDULE_FILE_COST;
+    schedule.count++;
+    pthread_mutex_unlock(&schedule.mutex);
+}
+
+int compare_scheduled_files(const void *first, const void *second) {
+    off_t first_cost = ((const scheduled_file_t *)first)->cost;
+    off_t second_cost = ((const scheduled_file_t *)second)->cost;
+    return (first_cost < second_cost) - (first_cost > second_cost);
+}
+
+void copy_file_batch(void *param) {
+    file_batch_t *batch = (file_batch_t *)param;
+    for (size_t i = 0; i < batch->count; i++) {
+        copy_file_entry(batch->entries[i]);
+        arena_reset();
+    }
+    free(batch);
+}
+
+void schedule_submit(void) {
+    qsort(schedule.files, schedule.count, sizeof(scheduled_file_t), compare_scheduled_files);
+
+    off_t total_cost = 0;
+    for (size_t i = 0; i < schedule.count; i++) {
+        total_cost += schedule.files[i].cost;
+    }
+    off_t batch_cost = total_cost / (copy_pool.size * SCHEDULE_TASKS_PER_WORKER);
+    if (batch_cost > SCHEDULE_BATCH_COST) {
+        batch_cost = SCHEDULE_BATCH_COST;
+    }
+
+    size_t tasks = 0;
+    size_t next = 0;
+    while (next < schedule.count) {
+        size_t count = 0;
+        off_t cost = 0;
+        do {
+            cost += schedule.files[next + count].cost;
+            count++;
+        } while (next + count < schedule.count && count < SCHEDULE_BATCH_FILES && cost < batch_cost);
+
+        file_batch_t *batch = malloc(sizeof(file_batch_t) + count * sizeof(entry_t *));
+        if (NULL != batch) {
+            batch->count = count;
+            for (size_t i = 0; i < count; i++) {
+                batch->entries[i] = schedule.files[next + i].entry;
+            }
+        }
+        if (NULL == batch || NO_ERROR != pool_submit(&copy_pool, copy_file_batch, batch)) {
+            for (size_t i = 0; i < count; i++) {
+                entry_done(schedule.files[next + i].entry);
+            }
+            free(batch);
+        }
+        next += count;
+        tasks++;
+    }
+
+    if (options.verbose) {
+        printf("Scheduled %zu files in %zu tasks\n", schedule.count, tasks);
+    }
+    free(schedule.files);
+    schedule.files = NULL;
+    schedule.count = 0;
+    schedule.capacity = 0;
+}
+
+int create_special_file(int dirfd, const char *name, const struct stat *stat_buf, const char *target) {
+    STATS_ADD(syscalls, 1);
+    return S_ISLNK(stat_buf->st_mode) ? symlinkat(target, dirfd, name) : mknodat(dirfd, name, stat_buf->st_mode, stat_buf->st_rdev);
+}
+
+int copy_special_file(const entry_t *entry) {
+    const char *src_name;
+    int src_dirfd = entry_anchor(entry, SIDE_SRC, &src_name);
+    struct stat stat_buf;
+    STATS_ADD(syscalls, 1);
+    if (ERROR == fstatat(src_dirfd, src_name, &stat_buf, AT_SYMLINK_NOFOLLOW)) {
+        perror(entry_path(entry, SIDE_SRC));
+        return ERROR;
+    }
+
+    char target[PATH_MAX];
+    if (S_ISLNK(stat_buf.st_mode)) {
+        STATS_ADD(syscalls, 1);
+        ssize_t length = readlinkat(src_dirfd, src_name, target, sizeof(target) - 1);
+        if (ERROR == length) {
+            perror(entry_path(entry, SIDE_SRC));
+            return ERROR;
+        }
+        target[length] = '\0';
+    }
+    if (NULL != options.archive_path) {
+        return archive_add_special(entry, &stat_buf, S_ISLNK(stat_buf.st_mode) ? target : NULL);
+    }
+
+    const char *name;
+    int dirfd = entry_anchor(entry, SIDE_DEST, &name);
+    int result = create_special_file(dirfd, name, &stat_buf, target);
+    if (ERROR == result && options.sync && EEXIST == errno && !is_directory_at(dirfd, name) && NO_ERROR == unlinkat(dirfd, name, 0)) {
+        result = create_special_file(dirfd, name, &stat_buf, target);
+    }
+    if (ERROR == result) {
+        perror(entry_path(entry, SIDE_DEST));
+        return ERROR;
+    }
+
+    if (options.metadata) {
+        struct timespec times[2] = { stat_buf.st_atim, stat_buf.st_mtim };
+        STATS_ADD(syscalls, 3);
+        if (ERROR == fchownat(dirfd, name, stat_buf.st_uid, stat_buf.st_gid, AT_SYMLINK_NOFOLLOW) && EPERM != errno) {
+            perror(entry_path(entry, SIDE_DEST));
+            result = ERROR;
+        }
+        if (!S_ISLNK(stat_buf.st_mode) && ERROR == fchmodat(dirfd, name, stat_buf.st_mode & 07777, 0)) {
+            perror(entry_path(entry, SIDE_DEST));
+            result = ERROR;
+        }
+        if (ERROR == utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW)) {
+            perror(entry_path(entry, SIDE_DEST));
+            result = ERROR;
+        }
+    }
+    if (options.verbose && NO_ERROR == result) {
+        printf("%s -> %s: %s\n", entry_path(entry, SIDE_SRC), entry_path(entry, SIDE_DEST), S_ISLNK(stat_buf.st_mode) ? "symlink" : "special file");
+    }
+    return result;
+}
+
+void copy_path(void *param) {
+    if (NULL == param) {
+        fprintf(stderr, "copy_path: invalid param\n");
+        return;
+    }
+
+    entry_t *entry = (entry_t *)param;
+    unsigned char type = entry->type;
+    struct statx statx_buf;
+    if (DT_UNKNOWN == type || (options.schedule && DT_REG == type)) {
+        if (ERROR == stat_entry(entry, options.schedule ? STATX_TYPE | STATX_SIZE | STATX_BLOCKS : STATX_TYPE, &statx_buf)) {
+            entry_done(entry);
+            return;
+        }
+        type = IFTODT(statx_buf.stx_mode);
+    }
+
+    if (DT_DIR == type) {
+        copy_directory(entry);
+        return;
+    }
+    if (DT_REG == type) {
+        if (options.schedule) {
+            off_t allocated = (off_t)statx_buf.stx_blocks * 512;
+            schedule_add(entry, allocated < (off_t)statx_buf.stx_size ? allocated : (off_t)statx_buf.stx_size);
+            return;
+        }
+        copy_file_entry(entry);
+        return;
+    }
+
+    long long started = now_usec();
+    stats_file_done(started, 0, copy_special_file(entry));
+    entry_done(entry);
+}
+
+long fd_gate_in_use(void) {
+    pthread_mutex_lock(&fd_gate.mutex);
+    long in_use = fd_gate.limit - fd_gate.available;
+    pthread_mutex_unlock(&fd_gate.mutex);
+    return in_use;
+}
+
+void print_progress(const stats_totals_t *totals, const stats_totals_t *last, double elapsed, double interval) {
+    fprintf(stderr, "[%.1fs] %lld files, %lld links, %lld dirs, %.1f MB | %.1f MB/s, %.0f files/s | %lld syscalls, %lld retries, %lld fd waits, %ld fds in use, %ld queued\n",
+            elapsed, totals->files, totals->links, totals->directories, totals->bytes / BYTES_PER_MB,
+            (totals->bytes - last->bytes) / BYTES_PER_MB / interval, (totals->files - last->files) / interval,
+            totals->syscalls, totals->retries, totals->fd_waits, fd_gate_in_use(), atomic_load(&copy_pool.queued));
+}
+
+void *progress_routine(void *param) {
+    long long started = *(long long *)param;
+    long long last_time = started;
+    stats_totals_t last;
+    memset(&last, 0, sizeof(last));
+
+    pthread_mutex_lock(&progress.mutex);
+    while (!progress.done) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += options.progress_interval;
+        while (!progress.done) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&progress.cond, &progress.mutex, &deadline)) {
+                break;
+            }
+        }
+        if (progress.done) {
+            break;
+        }
+        pthread_mutex_unlock(&progress.mutex);
+
+        stats_totals_t totals;
+        stats_collect(&totals);
+        long long now = now_usec();
+        print_progress(&totals, &last, (now - started) / (double)USEC_PER_SEC, (now - last_time) / (double)USEC_PER_SEC);
+        last = totals;
+        last_time = now;
+
+        pthread_mutex_lock(&progress.mutex);
+    }
+    pthread_mutex_unlock(&progress.mutex);
+    return NULL;
+}
+
+void progress_start(long long *started) {
+    int errorCode = pthread_create(&progress.thread, NULL, progress_routine, started);
+    if (NO_ERROR != errorCode) {
+        print_error("Unable to create progress thread", errorCode);
+        return;
+    }
+    progress.running = 1;
+}
+
+void progress_stop(void) {
+    if (!progress.running) {
+        return;
+    }
+    pthread_mutex_lock(&progress.mutex);
+    progress.done = 1;
+    pthread_cond_signal(&progress.cond);
+    pthread_mutex_unlock(&progress.mutex);
+
+    int errorCode = pthread_join(progress.thread, NULL);
+    if (NO_ERROR != errorCode) {
+        print_error("Unable to join progress thread", errorCode);
+    }
+    progress.running = 0;
+}
+
+void write_totals_json(FILE *file, const stats_totals_t *totals) {
+    fprintf(file, "\"files\": %lld, \"links\": %lld, \"directories\": %lld, \"bytes\": %lld, \"syscalls\": %lld, \"retries\": %lld, \"fd_waits\": %lld, \"errors\": %lld",
+            totals->files, totals->links, totals->directories, totals->bytes, totals->syscalls, totals->retries, totals->fd_waits, totals->errors);
+}
+
+void write_latency_json(FILE *file) {
+    fprintf(file, "  \"latency_usec\": [\n");
+    for (int size = 0; size < SIZE_BUCKETS; size++) {
+        if (size_bucket_limits[size] < 0) {
+            fprintf(file, "    {\"size_below\": null, \"buckets\": [");
+        }
+        else {
+            fprintf(file, "    {\"size_below\": %lld, \"buckets\": [", (long long)size_bucket_limits[size]);
+        }
+        int first = 1;
+        for (int latency = 0; latency < LATENCY_BUCKETS; latency++) {
+            long long count = atomic_load(&shared_stats.latency[size][latency]);
+            for (long i = 0; i < copy_pool.size; i++) {
+                count += atomic_load(&copy_pool.workers[i].stats.latency[size][latency]);
+            }
+            if (0 == count) {
+                continue;
+            }
+            if (LATENCY_BUCKETS - 1 == latency) {
+                fprintf(file, "%s{\"below\": null, \"count\": %lld}", first ? "" : ", ", count);
+            }
+            else {
+                fprintf(file, "%s{\"below\": %lld, \"count\": %lld}", first ? "" : ", ", 1LL << latency, count);
+            }
+            first = 0;
+        }
+        fprintf(file, "]}%s\n", SIZE_BUCKETS - 1 == size ? "" : ",");
+    }
+    fprintf(file, "  ]\n");
+}
+
+int write_summary(const char *path, long long elapsed) {
+    FILE *file = STRINGS_EQUAL(path, "-") ? stdout : fopen(path, "w");
+    if (NULL == file) {
+        perror(path);
+        return ERROR;
+    }
+
+    stats_totals_t totals;
+    stats_collect(&totals);
+    double seconds = elapsed / (double)USEC_PER_SEC;
+    double divisor = seconds > 0 ? seconds : 1;
+    fprintf(file, "{\n  \"elapsed_seconds\": %.6f,\n  \"threads\": %ld,\n  ", seconds, copy_pool.size);
+    write_totals_json(file, &totals);
+    fprintf(file, ",\n  \"mb_per_second\": %.3f,\n  \"files_per_second\": %.3f,\n  \"sparse_bytes_skipped\": %lld,\n",
+            totals.bytes / BYTES_PER_MB / divisor, totals.files / divisor, (long long)atomic_load(&sparse_bytes_skipped));
+
+    fprintf(file, "  \"workers\": [\n");
+    for (long i = 0; i < copy_pool.size; i++) {
+        stats_totals_t worker_totals;
+        memset(&worker_totals, 0, sizeof(worker_totals));
+        stats_read(&copy_pool.workers[i].stats, &worker_totals);
+        fprintf(file, "    {\"id\": %ld, ", i);
+        write_totals_json(file, &worker_totals);
+        fprintf(file, "}%s\n", copy_pool.size - 1 == i ? "" : ",");
+    }
+    fprintf(file, "  ],\n");
+    write_latency_json(file);
+    fprintf(file, "}\n");
+
+    if (stdout == file) {
+        return fflush(file);
+    }
+    if (ERROR == fclose(file)) {
+        perror(path);
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
+void verify_record(void *param) {
+    manifest_record_t *record = (manifest_record_t *)param;
+    fd_acquire(1);
+    int fd = open(record->path, O_RDONLY | O_CLOEXEC);
+    if (ERROR == fd) {
+        perror(record->path);
+        fd_release(1);
+        atomic_fetch_add(&verify_failures, 1);
+        return;
+    }
+
+    uint32_t crc;
+    off_t size;
+    if (ERROR == crc_fd(fd, &crc, &size)) {
+        perror(record->path);
+        atomic_fetch_add(&verify_failures, 1);
+    }
+    else if (size != record->size) {
+        fprintf(stderr, "%s: size %lld, expected %lld\n", record->path, (long long)size, (long long)record->size);
+        atomic_fetch_add(&verify_failures, 1);
+    }
+    else if (crc != record->crc) {
+        fprintf(stderr, "%s: checksum %08x, expected %08x\n", record->path, crc, record->crc);
+        atomic_fetch_add(&verify_failures, 1);
+    }
+    else {
+        STATS_ADD(files, 1);
+        STATS_ADD(bytes, size);
+    }
+    close(fd);
+    fd_release(1);
+}
+
+char *parse_manifest_path(char *escaped, const char *root) {
+    char *write = escaped;
+    for (char *read = escaped; '\0' != *read && '\n' != *read; read++) {
+        if ('\\' == read[0] && 'n' == read[1]) {
+            *write++ = '\n';
+            read++;
+        }
+        else if ('\\' == read[0] && '\\' == read[1]) {
+            *write++ = '\\';
+            read++;
+        }
+        else {
+            *write++ = *read;
+        }
+    }
+    *write = '\0';
+
+    if (STRINGS_EQUAL(escaped, ".")) {
+        return strdup(root);
+    }
+    char *path = malloc(strlen(root) + strlen(escaped) + 2);
+    if (NULL != path) {
+        sprintf(path, "%s/%s", root, escaped);
+    }
+    return path;
+}
+
+int load_manifest(const char *manifest_path, const char *root) {
+    FILE *file = fopen(manifest_path, "r");
+    if (NULL == file) {
+        perror(manifest_path);
+        return ERROR;
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    long line_number = 0;
+    int result = NO_ERROR;
+    while (-1 != getline(&line, &line_capacity, file)) {
+        line_number++;
+        unsigned int crc;
+        long long size;
+        int consumed = 0;
+        if (2 != sscanf(line, "%8x %lld %n", &crc, &size, &consumed) || 0 == consumed) {
+            fprintf(stderr, "%s:%ld: malformed manifest line\n", manifest_path, line_number);
+            result = ERROR;
+            break;
+        }
+        char *path = parse_manifest_path(line + consumed, root);
+        if (NULL == path) {
+            perror(manifest_path);
+            result = ERROR;
+            break;
+        }
+        manifest_push(path, NULL, (off_t)size, crc);
+    }
+    free(line);
+    fclose(file);
+    return result;
+}
+
+int verify_tree(const char *root) {
+    if (NO_ERROR != fd_gate_init(FD_RESERVE + options.threads)) {
+        return EXIT_FAILURE;
+    }
+    if (NO_ERROR != pool_init(&copy_pool, options.threads)) {
+        return EXIT_FAILURE;
+    }
+
+    long long started = now_usec();
+    if (options.progress_interval > 0) {
+        progress_start(&started);
+    }
+    if (NO_ERROR == load_manifest(options.verify_path, root)) {
+        for (size_t i = 0; i < manifest.count; i++) {
+            if (NO_ERROR != pool_submit(&copy_pool, verify_record, &manifest.records[i])) {
+                atomic_fetch_add(&verify_failures, 1);
+            }
+        }
+    }
+    else {
+        atomic_fetch_add(&verify_failures, 1);
+    }
+    pool_wait(&copy_pool);
+    long long elapsed = now_usec() - started;
+    progress_stop();
+
+    if (NULL != options.summary_path && ERROR == write_summary(options.summary_path, elapsed)) {
+        atomic_fetch_add(&verify_failures, 1);
+    }
+    pool_destroy(&copy_pool);
+    printf("Verified %zu files, %ld failed\n", manifest.count, atomic_load(&verify_failures));
+    for (size_t i = 0; i < manifest.count; i++) {
+        free(manifest.records[i].path);
+    }
+    free(manifest.records);
+    return 0 == atomic_load(&verify_failures) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void print_unpack_error(const char *path, int code) {
+    char buf[256];
+    fprintf(stderr, "%s/%s: %s\n", root_paths[SIDE_DEST], path, strerror_r(code, buf, sizeof(buf)));
+}
+
+void tar_entry_free(tar_entry_t *entry) {
+    free(entry->path);
+    free(entry->target);
+    free(entry->pax);
+}
+
+int archive_fill(archive_reader_t *reader) {
+    while (reader->start == reader->end) {
+        ssize_t bytes_read = read(reader->fd, reader->buffer, ARCHIVE_BUFFER_SIZE);
+        STATS_ADD(syscalls, 1);
+        if (ERROR == bytes_read) {
+            if (EINTR == errno) {
+                STATS_ADD(retries, 1);
+                continue;
+            }
+            perror(options.extract_path);
+            return ERROR;
+        }
+        if (0 == bytes_read) {
+            return NOT_SUPPORTED;
+        }
+        reader->start = 0;
+        reader->end = bytes_read;
+    }
+    return NO_ERROR;
+}
+
+int archive_read(archive_reader_t *reader, char *out, off_t length) {
+    while (length > 0) {
+        int result = archive_fill(reader);
+        if (NOT_SUPPORTED == result) {
+            fprintf(stderr, "%s: unexpected end of archive\n", options.extract_path);
+        }
+        if (NO_ERROR != result) {
+            return ERROR;
+        }
+        size_t chunk = reader->end - reader->start;
+        if ((off_t)chunk > length) {
+            chunk = length;
+        }
+        if (NULL != out) {
+            memcpy(out, reader->buffer + reader->start, chunk);
+            out += chunk;
+        }
+        reader->start += chunk;
+        length -= chunk;
+    }
+    return NO_ERROR;
+}
+
+char *archive_read_string(archive_reader_t *reader, off_t size) {
+    char *string = malloc(size + 1);
+    if (NULL == string) {
+        perror(options.extract_path);
+        return NULL;
+    }
+    if (ERROR == archive_read(reader, string, size)) {
+        free(string);
+        return NULL;
+    }
+    string[size] = '\0';
+    return string;
+}
+
+unsigned long long tar_number(const char *field, size_t width) {
+    const unsigned char *bytes = (const unsigned char *)field;
+    unsigned long long value = 0;
+    if (bytes[0] & 0x80) {
+        value = bytes[0] & 0x3f;
+        for (size_t i = 1; i < width; i++) {
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+    size_t i = 0;
+    while (i < width && ' ' == field[i]) {
+        i++;
+    }
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = (value << 3) | (unsigned long long)(field[i] - '0');
+    }
+    return value;
+}
+
+int tar_verify_checksum(const tar_header_t *header) {
+    const unsigned char *bytes = (const unsigned char *)header;
+    unsigned long long sum = 0;
+    for (size_t i = 0; i < sizeof(tar_header_t); i++) {
+        sum += i >= offsetof(tar_header_t, checksum) && i < offsetof(tar_header_t, type) ? ' ' : bytes[i];
+    }
+    return sum == tar_number(header->checksum, sizeof(header->checksum));
+}
+
+int is_zero_block(const tar_header_t *header) {
+    const char *bytes = (const char *)header;
+    for (size_t i = 0; i < sizeof(tar_header_t); i++) {
+        if ('\0' != bytes[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int pax_next(const char **cursor, const char *end, const char **key, size_t *key_length, const char **value, size_t *value_length) {
+    if (*cursor >= end) {
+        return 0;
+    }
+    char *space;
+    unsigned long length = strtoul(*cursor, &space, 10);
+    if (' ' != *space || length <= (size_t)(space - *cursor) || length > (size_t)(end - *cursor) || '\n' != (*cursor)[length - 1]) {
+        return ERROR;
+    }
+    const char *record_end = *cursor + length - 1;
+    const char *equals = memchr(space + 1, '=', record_end - space - 1);
+    if (NULL == equals) {
+        return ERROR;
+    }
+    *key = space + 1;
+    *key_length = equals - *key;
+    *value = equals + 1;
+    *value_length = record_end - *value;
+    *cursor = record_end + 1;
+    return 1;
+}
+
+int pax_key_is(const char *key, size_t key_length, const char *name) {
+    return strlen(name) == key_length && 0 == memcmp(key, name, key_length);
+}
+
+struct timespec pax_time(const char *value) {
+    char *fraction;
+    struct timespec time = { strtoll(value, &fraction, 10), 0 };
+    if ('.' == *fraction) {
+        long scale = 100000000;
+        for (const char *digit = fraction + 1; *digit >= '0' && *digit <= '9' && scale > 0; digit++, scale /= 10) {
+            time.tv_nsec += (*digit - '0') * scale;
+        }
+    }
+    return time;
+}
+
+int pax_apply(tar_entry_t *entry) {
+    const char *cursor = entry->pax;
+    const char *end = entry->pax + entry->pax_length;
+    const char *key;
+    const char *value;
+    size_t key_length;
+    size_t value_length;
+    int result;
+    while (1 == (result = pax_next(&cursor, end, &key, &key_length, &value, &value_length))) {
+        char **string = pax_key_is(key, key_length, "path") ? &entry->path
+                      : pax_key_is(key, key_length, "linkpath") ? &entry->target : NULL;
+        if (NULL != string) {
+            free(*string);
+            if (NULL == (*string = malloc(value_length + 2))) {
+                return ERROR;
+            }
+            memcpy(*string, value, value_length);
+            (*string)[value_length] = '\0';
+        }
+        else if (pax_key_is(key, key_length, "size")) {
+            entry->size = strtoll(value, NULL, 10);
+        }
+        else if (pax_key_is(key, key_length, "uid")) {
+            entry->uid = strtoul(value, NULL, 10);
+        }
+        else if (pax_key_is(key, key_length, "gid")) {
+            entry->gid = strtoul(value, NULL, 10);
+        }
+        else if (pax_key_is(key, key_length, "atime")) {
+            entry->times[0] = pax_time(value);
+        }
+        else if (pax_key_is(key, key_length, "mtime")) {
+            entry->times[1] = pax_time(value);
+        }
+    }
+    return result;
+}
+
+int tar_parse_entry(const tar_header_t *header, tar_entry_t *entry) {
+    size_t prefix_length = strnlen(header->prefix, sizeof(header->prefix));
+    size_t name_length = strnlen(header->name, sizeof(header->name));
+    size_t target_length = strnlen(header->linkname, sizeof(header->linkname));
+    if (NULL == entry->path) {
+        if (NULL == (entry->path = malloc(prefix_length + name_length + 3))) {
+            return ERROR;
+        }
+        char *cursor = entry->path;
+        if (prefix_length > 0) {
+            memcpy(cursor, header->prefix, prefix_length);
+            cursor += prefix_length;
+            *cursor++ = '/';
+        }
+        memcpy(cursor, header->name, name_length);
+        cursor[name_length] = '\0';
+    }
+    if (NULL == entry->target && target_length > 0 && NULL == (entry->target = strndup(header->linkname, target_length))) {
+        return ERROR;
+    }
+    entry->type = header->type;
+    entry->mode = tar_number(header->mode, sizeof(header->mode)) & 07777;
+    entry->uid = tar_number(header->uid, sizeof(header->uid));
+    entry->gid = tar_number(header->gid, sizeof(header->gid));
+    entry->size = tar_number(header->size, sizeof(header->size));
+    entry->rdev = makedev(tar_number(header->devmajor, sizeof(header->devmajor)), tar_number(header->devminor, sizeof(header->devminor)));
+    entry->times[0].tv_nsec = UTIME_OMIT;
+    entry->times[1].tv_sec = tar_number(header->mtime, sizeof(header->mtime));
+    return NULL == entry->pax ? NO_ERROR : pax_apply(entry);
+}
+
+int sanitize_path(char *path) {
+    char *start = path;
+    while ('/' == *start) {
+        start++;
+    }
+    size_t length = strlen(start);
+    memmove(path, start, length + 1);
+    while (length > 0 && '/' == path[length - 1]) {
+        path[--length] = '\0';
+    }
+    if (0 == length) {
+        strcpy(path, ".");
+    }
+    for (char *component = path; NULL != component; component = strchr(component, '/')) {
+        component += '/' == *component;
+        if ('.' == component[0] && '.' == component[1] && ('/' == component[2] || '\0' == component[2])) {
+            return ERROR;
+        }
+    }
+    return NO_ERROR;
+}
+
+// Opens path below the extraction root without following any symlink, so a
+// link planted by an earlier entry cannot redirect a later one outside it.
+// Kernels without openat2 get the same guarantee one component at a time.
+int open_beneath(const char *path, int flags) {
+#if defined(HAVE_OPENAT2) && defined(SYS_openat2)
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+    STATS_ADD(syscalls, 1);
+    int opened = (int)syscall(SYS_openat2, archive.root_fd, path, &how, sizeof(how));
+    if (ERROR != opened || ENOSYS != errno) {
+        return opened;
+    }
+#endif
+
+    char *copy = strdup(path);
+    if (NULL == copy) {
+        return ERROR;
+    }
+    STATS_ADD(syscalls, 1);
+    int fd = openat(archive.root_fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    const char *last = ".";
+    char *saveptr = NULL;
+    for (char *component = strtok_r(copy, "/", &saveptr); ERROR != fd && NULL != component; component = strtok_r(NULL, "/", &saveptr)) {
+        if (STRINGS_EQUAL(component, ".")) {
+            continue;
+        }
+        if (!STRINGS_EQUAL(last, ".")) {
+            STATS_ADD(syscalls, 1);
+            int next = openat(fd, last, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            close(fd);
+            fd = next;
+        }
+        last = component;
+    }
+    int result = ERROR;
+    if (ERROR != fd) {
+        STATS_ADD(syscalls, 1);
+        result = openat(fd, last, flags | O_NOFOLLOW | O_CLOEXEC);
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    }
+    free(copy);
+    return result;
+}
+
+// Opens the directory that holds path and points leaf at its last component
+int open_parent_beneath(const char *path, const char **leaf) {
+    const char *slash = strrchr(path, '/');
+    *leaf = NULL == slash ? path : slash + 1;
+    char *parent = NULL == slash ? strdup(".") : strndup(path, slash - path);
+    if (NULL == parent) {
+        return ERROR;
+    }
+    int fd = open_beneath(parent, O_PATH | O_DIRECTORY);
+    int saved_errno = errno;
+    free(parent);
+    errno = saved_errno;
+    return fd;
+}
+
+int set_pax_xattrs(int fd, const tar_entry_t *entry) {
+    const char *cursor = entry->pax;
+    const char *end = entry->pax + entry->pax_length;
+    const char *key;
+    const char *value;
+    size_t key_length;
+    size_t value_length;
+    int result = NO_ERROR;
+    while (1 == pax_next(&cursor, end, &key, &key_length, &value, &value_length)) {
+        size_t prefix_length = sizeof("SCHILY.xattr.") - 1;
+        if (key_length <= prefix_length || key_length - prefix_length > XATTR_NAME_MAX || 0 != memcmp(key, "SCHILY.xattr.", prefix_length)) {
+            continue;
+        }
+        char name[XATTR_NAME_MAX + 1];
+        memcpy(name, key + prefix_length, key_length - prefix_length);
+        name[key_length - prefix_length] = '\0';
+        STATS_ADD(syscalls, 1);
+        if (ERROR == fsetxattr(fd, name, value, value_length, 0) && !is_ignored_xattr_error(errno)) {
+            print_unpack_error(entry->path, errno);
+            result = ERROR;
+        }
+    }
+    return result;
+}
+
+int apply_tar_metadata(int fd, const tar_entry_t *entry) {
+    int result = NO_ERROR;
+    if (options.metadata) {
+        STATS_ADD(syscalls, 1);
+        if (ERROR == fchown(fd, entry->uid, entry->gid) && EPERM != errno) {
+            print_unpack_error(entry->path, errno);
+            result = ERROR;
+        }
+        if (NULL != entry->pax && ERROR == set_pax_xattrs(fd, entry)) {
+            result = ERROR;
+        }
+    }
+    STATS_ADD(syscalls, 1);
+    if (ERROR == fchmod(fd, entry->mode)) {
+        print_unpack_error(entry->path, errno);
+        result = ERROR;
+    }
+    if (options.metadata) {
+        STATS_ADD(syscalls, 1);
+        if (ERROR == futimens(fd, entry->times)) {
+            print_unpack_error(entry->path, errno);
+            result = ERROR;
+        }
+    }
+    return result;
+}
+
+int apply_tar_metadata_at(const tar_entry_t *entry, int parent_fd, const char *leaf) {
+    int result = NO_ERROR;
+    if ('2' != entry->type) {
+        STATS_ADD(syscalls, 1);
+        if (ERROR == fchmodat(parent_fd, leaf, entry->mode, 0)) {
+            print_unpack_error(entry->path, errno);
+            result = ERROR;
+        }
+    }
+    if (options.metadata) {
+        STATS_ADD(syscalls, 2);
+        if (ERROR == fchownat(parent_fd, leaf, entry->uid, entry->gid, AT_SYMLINK_NOFOLLOW) && EPERM != errno) {
+            print_unpack_error(entry->path, errno);
+            result = ERROR;
+        }
+        if (ERROR == utimensat(parent_fd, leaf, entry->times, AT_SYMLINK_NOFOLLOW)) {
+            print_unpack_error(entry->path, errno);
+            result = ERROR;
+        }
+    }
+    return result;
+}
+
+size_t unpack_path_bucket(const char *path) {
+    uint64_t hash = HASH_PRIME;
+    for (; '\0' != *path; path++) {
+        hash = (hash ^ (unsigned char)*path) * HASH_PRIME;
+    }
+    return (size_t)((hash ^ hash >> 32) % UNPACK_IN_FLIGHT_BUCKETS);
+}
+
+int unpack_is_in_flight(const char *path) {
+    for (unpack_file_t *file = archive.in_flight[unpack_path_bucket(path)]; NULL != file; file = file->next) {
+        if (STRINGS_EQUAL(file->entry.path, path)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Later members of an archive replace earlier ones with the same name, so an
+// entry is not applied while a worker still writes an earlier one at its path
+void unpack_wait_path(const char *path) {
+    pthread_mutex_lock(&archive.mutex);
+    while (unpack_is_in_flight(path)) {
+        pthread_cond_wait(&archive.space_cond, &archive.mutex);
+    }
+    pthread_mutex_unlock(&archive.mutex);
+}
+
+void unpack_reserve(unpack_file_t *file) {
+    pthread_mutex_lock(&archive.mutex);
+    while (archive.queued > ARCHIVE_QUEUE_MAX) {
+        pthread_cond_wait(&archive.space_cond, &archive.mutex);
+    }
+    archive.queued += file->entry.size;
+    size_t bucket = unpack_path_bucket(file->entry.path);
+    file->next = archive.in_flight[bucket];
+    archive.in_flight[bucket] = file;
+    pthread_mutex_unlock(&archive.mutex);
+}
+
+void unpack_release(unpack_file_t *file) {
+    pthread_mutex_lock(&archive.mutex);
+    archive.queued -= file->entry.size;
+    unpack_file_t **link = &archive.in_flight[unpack_path_bucket(file->entry.path)];
+    while (*link != file) {
+        link = &(*link)->next;
+    }
+    *link = file->next;
+    pthread_cond_signal(&archive.space_cond);
+    pthread_mutex_unlock(&archive.mutex);
+}
+
+int unpack_open_file(const tar_entry_t *entry) {
+    const char *leaf;
+    int parent_fd = open_parent_beneath(entry->path, &leaf);
+    int fd = ERROR;
+    if (ERROR != parent_fd) {
+        STATS_ADD(syscalls, 1);
+        fd = openat(parent_fd, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        int saved_errno = errno;
+        close(parent_fd);
+        errno = saved_errno;
+    }
+    if (ERROR == fd) {
+        print_unpack_error(entry->path, errno);
+    }
+    return fd;
+}
+
+void unpack_file(void *param) {
+    unpack_file_t *file = (unpack_file_t *)param;
+    tar_entry_t *entry = &file->entry;
+    int result = ERROR;
+    fd_acquire(2);
+    int fd = unpack_open_file(entry);
+    if (ERROR != fd) {
+        if (ERROR == write_block_at(fd, file->data, 0, entry->size)) {
+            print_unpack_error(entry->path, errno);
+        }
+        else {
+            result = apply_tar_metadata(fd, entry);
+        }
+        close(fd);
+    }
+    fd_release(2);
+    if (options.verbose && NO_ERROR == result) {
+        printf("%s -> %s/%s\n", options.extract_path, root_paths[SIDE_DEST], entry->path);
+    }
+    stats_file_done(file->started, entry->size, result);
+    unpack_release(file);
+    tar_entry_free(entry);
+    free(file->data);
+    free(file);
+}
+
+// Only a failed archive read is returned: a file that cannot be written is
+// counted as failed, but its data is still consumed and NO_ERROR returned so
+// the rest of the archive stream keeps being extracted
+int unpack_large_file(archive_reader_t *reader, tar_entry_t *entry, char *buffer, long long started) {
+    int result = ERROR;
+    fd_acquire(2);
+    int fd = unpack_open_file(entry);
+    off_t done = 0;
+    while (done < entry->size) {
+        off_t length = entry->size - done > ARCHIVE_BUFFER_SIZE ? ARCHIVE_BUFFER_SIZE : entry->size - done;
+        if (ERROR == archive_read(reader, buffer, length)) {
+            if (ERROR != fd) {
+                close(fd);
+            }
+            fd_release(2);
+            return ERROR;
+        }
+        if (ERROR != fd && ERROR == write_block_at(fd, buffer, done, length)) {
+            print_unpack_error(entry->path, errno);
+            close(fd);
+            fd = ERROR;
+        }
+        done += length;
+    }
+    if (ERROR != fd) {
+        result = apply_tar_metadata(fd, entry);
+        close(fd);
+    }
+    fd_release(2);
+    if (options.verbose && NO_ERROR == result) {
+        printf("%s -> %s/%s\n", options.extract_path, root_paths[SIDE_DEST], entry->path);
+    }
+    stats_file_done(started, entry->size, result);
+    return NO_ERROR;
+}
+
+int unpack_regular(archive_reader_t *reader, tar_entry_t *entry, char *buffer) {
+    long long started = now_usec();
+    if (entry->size > ARCHIVE_INLINE_MAX) {
+        int result = unpack_large_file(reader, entry, buffer, started);
+        tar_entry_free(entry);
+        return result;
+    }
+
+    unpack_file_t *file = malloc(sizeof(unpack_file_t));
+    char *data = malloc(entry->size + 1);
+    if (NULL == file || NULL == data) {
+        perror(options.extract_path);
+        free(file);
+        free(data);
+        tar_entry_free(entry);
+        return ERROR;
+    }
+    if (ERROR == archive_read(reader, data, entry->size)) {
+        free(file);
+        free(data);
+        tar_entry_free(entry);
+        return ERROR;
+    }
+    file->entry = *entry;
+    file->data = data;
+    file->started = started;
+    unpack_reserve(file);
+    if (NO_ERROR != pool_submit(&copy_pool, unpack_file, file)) {
+        unpack_file(file);
+    }
+    return NO_ERROR;
+}
+
+int unpack_directory(tar_entry_t *entry, unpack_dirs_t *dirs) {
+    const char *leaf;
+    int parent_fd = open_parent_beneath(entry->path, &leaf);
+    int result = ERROR;
+    if (ERROR != parent_fd) {
+        STATS_ADD(syscalls, 1);
+        result = mkdirat(parent_fd, leaf, S_IRWXU);
+        if (ERROR == result && EEXIST == errno && is_directory_at(parent_fd, leaf)) {
+            result = NO_ERROR;
+        }
+        int saved_errno = errno;
+        close(parent_fd);
+        errno = saved_errno;
+    }
+    if (ERROR == result) {
+        print_unpack_error(entry->path, errno);
+        STATS_ADD(errors, 1);
+        tar_entry_free(entry);
+        return NO_ERROR;
+    }
+    STATS_ADD(directories, 1);
+    if (dirs->count == dirs->capacity) {
+        size_t capacity = 0 == dirs->capacity ? UNPACK_DIRS_INITIAL_CAPACITY : dirs->capacity * 2;
+        tar_entry_t *grown = realloc(dirs->entries, capacity * sizeof(tar_entry_t));
+        if (NULL == grown) {
+            perror(options.extract_path);
+            tar_entry_free(entry);
+            return ERROR;
+        }
+        dirs->entries = grown;
+        dirs->capacity = capacity;
+    }
+    dirs->entries[dirs->count++] = *entry;
+    return NO_ERROR;
+}
+
+int create_tar_entry(const tar_entry_t *entry, int parent_fd, const char *leaf) {
+    STATS_ADD(syscalls, 1);
+    switch (entry->type) {
+        case '1': {
+            const char *target_leaf;
+            int target_parent_fd = open_parent_beneath(entry->target, &target_leaf);
+            if (ERROR == target_parent_fd) {
+                return ERROR;
+            }
+            int result = linkat(target_parent_fd, target_leaf, parent_fd, leaf, 0);
+            int saved_errno = errno;
+            close(target_parent_fd);
+            errno = saved_errno;
+            return result;
+        }
+        case '2':
+            return symlinkat(entry->target, parent_fd, leaf);
+        default:
+            return mknodat(parent_fd, leaf,
+                           entry->mode | ('3' == entry->type ? S_IFCHR : '4' == entry->type ? S_IFBLK : S_IFIFO), entry->rdev);
+    }
+}
+
+void unpack_special(tar_entry_t *entry) {
+    long long started = now_usec();
+    int linked = '1' == entry->type;
+    int result = ERROR;
+    const char *leaf = NULL;
+    int parent_fd = ERROR;
+    if ((linked || '2' == entry->type) && (NULL == entry->target || (linked && ERROR == sanitize_path(entry->target)))) {
+        errno = EINVAL;
+    }
+    else {
+        if (linked) {
+            unpack_wait_path(entry->target);
+        }
+        parent_fd = open_parent_beneath(entry->path, &leaf);
+    }
+    if (ERROR != parent_fd) {
+        result = create_tar_entry(entry, parent_fd, leaf);
+        if (ERROR == result && linked && ENOENT == errno) {
+            pool_wait(&copy_pool);
+            result = create_tar_entry(entry, parent_fd, leaf);
+        }
+        if (ERROR == result && EEXIST == errno && !is_directory_at(parent_fd, leaf)
+            && NO_ERROR == unlinkat(parent_fd, leaf, 0)) {
+            result = create_tar_entry(entry, parent_fd, leaf);
+        }
+    }
+    if (ERROR == result) {
+        print_unpack_error(entry->path, errno);
+    }
+    else if (linked) {
+        STATS_ADD(links, 1);
+    }
+    else {
+        result = apply_tar_metadata_at(entry, parent_fd, leaf);
+    }
+    if (ERROR != parent_fd) {
+        close(parent_fd);
+    }
+    if (options.verbose && NO_ERROR == result) {
+        printf("%s -> %s/%s\n", options.extract_path, root_paths[SIDE_DEST], entry->path);
+    }
+    if (!linked || ERROR == result) {
+        stats_file_done(started, 0, result);
+    }
+    tar_entry_free(entry);
+}
+
+int unpack_archive(archive_reader_t *reader, unpack_dirs_t *dirs, char *buffer) {
+    tar_header_t header;
+    tar_entry_t pending;
+    memset(&pending, 0, sizeof(pending));
+    int result = NO_ERROR;
+    while (NO_ERROR == result) {
+        int filled = archive_fill(reader);
+        if (NOT_SUPPORTED == filled) {
+            break;
+        }
+        if (NO_ERROR != filled || ERROR == archive_read(reader, (char *)&header, sizeof(header))) {
+            result = ERROR;
+            break;
+        }
+        if (is_zero_block(&header)) {
+            break;
+        }
+        if (!tar_verify_checksum(&header)) {
+            fprintf(stderr, "%s: invalid header checksum\n", options.extract_path);
+            result = ERROR;
+            break;
+        }
+
+        off_t size = tar_number(header.size, sizeof(header.size));
+        char **extension = 'x' == header.type ? &pending.pax : 'L' == header.type ? &pending.path : 'K' == header.type ? &pending.target : NULL;
+        if (NULL != extension) {
+            free(*extension);
+            *extension = archive_read_string(reader, size);
+            if (NULL == *extension || ERROR == archive_read(reader, NULL, ALIGN_UP(size, TAR_BLOCK_SIZE) - size)) {
+                result = ERROR;
+            }
+            if ('x' == header.type) {
+                pending.pax_length = size;
+            }
+            continue;
+        }
+
+        tar_entry_t entry = pending;
+        memset(&pending, 0, sizeof(pending));
+        if (ERROR == tar_parse_entry(&header, &entry)) {
+            fprintf(stderr, "%s: malformed extended header\n", options.extract_path);
+            tar_entry_free(&entry);
+            result = ERROR;
+            break;
+        }
+        off_t padding = ALIGN_UP(entry.size, TAR_BLOCK_SIZE) - entry.size;
+        if (ERROR == sanitize_path(entry.path)) {
+            fprintf(stderr, "%s: %s: unsafe path skipped\n", options.extract_path, entry.path);
+            STATS_ADD(errors, 1);
+            result = archive_read(reader, NULL, entry.size + padding);
+            tar_entry_free(&entry);
+            continue;
+        }
+
+        unpack_wait_path(entry.path);
+        switch (entry.type) {
+            case '0':
+            case '\0':
+            case '7':
+                result = unpack_regular(reader, &entry, buffer);
+                break;
+            case '5':
+                result = unpack_directory(&entry, dirs);
+                padding += entry.size;
+                break;
+            case '1':
+            case '2':
+            case '3':
+            case '4':
+            case '6':
+                padding += entry.size;
+                unpack_special(&entry);
+                break;
+            case 'g':
+                padding += entry.size;
+                tar_entry_free(&entry);
+                break;
+            default:
+                fprintf(stderr, "%s: %s: unsupported entry type '%c' skipped\n", options.extract_path, entry.path, entry.type);
+                padding += entry.size;
+                tar_entry_free(&entry);
+                break;
+        }
+        if (NO_ERROR == result) {
+            result = archive_read(reader, NULL, padding);
+        }
+    }
+    tar_entry_free(&pending);
+    return result;
+}
+
+int extract_tree(const char *root) {
+    if (NO_ERROR != fd_gate_init(FD_RESERVE + options.threads)) {
+        return EXIT_FAILURE;
+    }
+    if (ERROR == mkdir(root, S_IRWXU) && EEXIST != errno) {
+        perror(root);
+        return EXIT_FAILURE;
+    }
+    root_paths[SIDE_DEST] = root;
+    root_lengths[SIDE_DEST] = strlen(root);
+    archive.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    archive_reader_t reader = { STRINGS_EQUAL(options.extract_path, "-") ? STDIN_FILENO : open(options.extract_path, O_RDONLY | O_CLOEXEC),
+                                malloc(ARCHIVE_BUFFER_SIZE), 0, 0 };
+    char *buffer = malloc(ARCHIVE_BUFFER_SIZE);
+    if (ERROR == archive.root_fd || ERROR == reader.fd || NULL == reader.buffer || NULL == buffer) {
+        perror(ERROR == archive.root_fd ? root : options.extract_path);
+        free(reader.buffer);
+        free(buffer);
+        return EXIT_FAILURE;
+    }
+    if (NO_ERROR != pool_init(&copy_pool, options.threads)) {
+        free(reader.buffer);
+        free(buffer);
+        return EXIT_FAILURE;
+    }
+
+    long long started = now_usec();
+    if (options.progress_interval > 0) {
+        progress_start(&started);
+    }
+    unpack_dirs_t dirs = { NULL, 0, 0 };
+    int result = unpack_archive(&reader, &dirs, buffer);
+    pool_wait(&copy_pool);
+
+    for (size_t i = dirs.count; i-- > 0; ) {
+        tar_entry_t *entry = &dirs.entries[i];
+        int fd = open_beneath(entry->path, O_RDONLY | O_DIRECTORY);
+        if (ERROR == fd) {
+            print_unpack_error(entry->path, errno);
+            result = ERROR;
+        }
+        else {
+            if (ERROR == apply_tar_metadata(fd, entry)) {
+                result = ERROR;
+            }
+            close(fd);
+        }
+        tar_entry_free(entry);
+    }
+    long long elapsed = now_usec() - started;
+    progress_stop();
+
+    if (NULL != options.summary_path && ERROR == write_summary(options.summary_path, elapsed)) {
+        result = ERROR;
+    }
+    stats_totals_t totals;
+    stats_collect(&totals);
+    pool_destroy(&copy_pool);
+    if (STDIN_FILENO != reader.fd) {
+        close(reader.fd);
+    }
+    close(archive.root_fd);
+    free(dirs.entries);
+    free(reader.buffer);
+    free(buffer);
+    return NO_ERROR == result && 0 == totals.errors ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+long convert_number_from_string(char *string, long *out) {
+    if (NULL == string || NULL == out) {
+        fprintf(stderr, "convert_number_from_string : string or out was NULL\n");
+        return ERROR;
+    }
+
+    errno = 0;
+    char *endptr = "";
+    *out = strtol(string, &endptr, 10);
+
+    if (NO_ERROR != errno) {
+        perror("Can't convert given number");
+        return ERROR;
+    }
+    if (NO_ERROR != strcmp(endptr, "")) {
+        fprintf(stderr, "Number contains invalid symbols\n");
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
+int parse_strategy(const char *name, copy_strategy_t *out) {
+    for (int i = 0; i < STRATEGY_COUNT; i++) {
+        if (STRINGS_EQUAL(name, strategy_names[i])) {
+            *out = (copy_strategy_t)i;
+            return NO_ERROR;
+        }
+    }
+    if (STRINGS_EQUAL(name, "auto")) {
+        *out = STRATEGY_COPY_FILE_RANGE;
+        return NO_ERROR;
+    }
+    fprintf(stderr, "Unknown copy strategy: %s\n", name);
+    return ERROR;
+}
+
+int convert_size_from_string(char *string, off_t *out) {
+    if (NULL == string || NULL == out) {
+        fprintf(stderr, "convert_size_from_string : string or out was NULL\n");
+        return ERROR;
+    }
+
+    errno = 0;
+    char *endptr = "";
+    long long value = strtoll(string, &endptr, 10);
+    if (NO_ERROR != errno) {
+        perror("Can't convert given size");
+        return ERROR;
+    }
+
+    int shift = 0;
+    switch (*endptr) {
+        case 'K': case 'k': shift = 10; endptr++; break;
+        case 'M': case 'm': shift = 20; endptr++; break;
+        case 'G': case 'g': shift = 30; endptr++; break;
+        default: break;
+    }
+    if (NO_ERROR != strcmp(endptr, "") || value < 0 || value > (LLONG_MAX >> shift)) {
+        fprintf(stderr, "Size contains invalid symbols\n");
+        return ERROR;
+    }
+    *out = (off_t)(value << shift);
+    return NO_ERROR;
+}
+
+int parse_pipeline_threads(char *string) {
+    char *separator = strchr(string, ':');
+    if (NULL == separator) {
+        fprintf(stderr, "Pipeline threads must be given as readers:writers\n");
+        return ERROR;
+    }
+    *separator = '\0';
+    if (ERROR == convert_number_from_string(string, &options.readers)
+        || ERROR == convert_number_from_string(separator + 1, &options.writers)) {
+        return ERROR;
+    }
+    if (options.readers < 1 || options.writers < 1) {
+        fprintf(stderr, "Number of pipeline threads must be positive number\n");
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
+int parse_reflink_mode(const char *name, reflink_mode_t *out) {
+    const char *names[] = { "auto", "always", "never" };
+    for (int i = 0; i < 3; i++) {
+        if (STRINGS_EQUAL(name, names[i])) {
+            *out = (reflink_mode_t)i;
+            return NO_ERROR;
+        }
+    }
+    fprintf(stderr, "Unknown reflink mode: %s\n", name);
+    return ERROR;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-j threads] [-e auto|copy_file_range|sendfile|splice|read_write] [-u] [-T chunk_threshold] [-c chunk_size] [-s [-H]] [-a] [-D] [-S] [-r auto|always|never] [-P readers:writers] [-p seconds] [-J summary.json] [-M manifest] [-v] src_path dest_path\n"
+                    "       %s [-j threads] [-p seconds] [-J summary.json] -V manifest dest_path\n"
+                    "       %s [-j threads] [-S] [-a] [-p seconds] [-J summary.json] [-v] -A archive.tar|- src_path\n"
+                    "       %s [-j threads] [-a] [-p seconds] [-J summary.json] [-v] -X archive.tar|- dest_path\n", program, program, program, program);
+}
+
+int parse_options(int argc, char **argv) {
+    options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (options.threads < 1) {
+        options.threads = 1;
+    }
+    options.chunk_threshold = DEFAULT_CHUNK_THRESHOLD;
+    options.chunk_size = DEFAULT_CHUNK_SIZE;
+
+    int option;
+    while (-1 != (option = getopt(argc, argv, "j:e:uT:c:sHaDSr:P:p:J:M:V:A:X:v"))) {
+        switch (option) {
+            case 'j':
+                if (ERROR == convert_number_from_string(optarg, &options.threads)) {
+                    return ERROR;
+                }
+                if (options.threads < 1) {
+                    fprintf(stderr, "Number of threads must be positive number\n");
+                    return ERROR;
+                }
+                break;
+            case 'e':
+                if (ERROR == parse_strategy(optarg, &options.strategy)) {
+                    return ERROR;
+                }
+                break;
+            case 'u':
+                options.uring = 1;
+                break;
+            case 'T':
+                if (ERROR == convert_size_from_string(optarg, &options.chunk_threshold)) {
+                    return ERROR;
+                }
+                break;
+            case 'c':
+                if (ERROR == convert_size_from_string(optarg, &options.chunk_size)) {
+                    return ERROR;
+                }
+                if (options.chunk_size < 1) {
+                    fprintf(stderr, "Chunk size must be positive number\n");
+                    return ERROR;
+                }
+                break;
+            case 's':
+                options.sync = 1;
+                break;
+            case 'H':
+                options.hash = 1;
+                break;
+            case 'a':
+                options.metadata = 1;
+                break;
+            case 'D':
+                options.direct = 1;
+                break;
+            case 'S':
+                options.schedule = 1;
+                break;
+            case 'r':
+                if (ERROR == parse_reflink_mode(optarg, &options.reflink)) {
+                    return ERROR;
+                }
+                break;
+            case 'P':
+                if (ERROR == parse_pipeline_threads(optarg)) {
+                    return ERROR;
+                }
+                break;
+            case 'p':
+                if (ERROR == convert_number_from_string(optarg, &options.progress_interval)) {
+                    return ERROR;
+                }
+                if (options.progress_interval < 1) {
+                    fprintf(stderr, "Progress interval must be positive number\n");
+                    return ERROR;
+                }
+                break;
+            case 'J':
+                options.summary_path = optarg;
+                break;
+            case 'M':
+                options.manifest_path = optarg;
+                break;
+            case 'V':
+                options.verify_path = optarg;
+                break;
+            case 'A':
+                options.archive_path = optarg;
+                break;
+            case 'X':
+                options.extract_path = optarg;
+                break;
+            case 'v':
+                options.verbose = 1;
+                break;
+            default:
+                return ERROR;
+        }
+    }
+
+    if (NULL != options.verify_path) {
+        return 1 == argc - optind && NULL == options.manifest_path ? NO_ERROR : ERROR;
+    }
+    if (NULL != options.archive_path || NULL != options.extract_path) {
+        if (NULL != options.archive_path && NULL != options.extract_path) {
+            return ERROR;
+        }
+        if (options.sync || NULL != options.manifest_path || options.readers > 0) {
+            fprintf(stderr, "Archive modes cannot be combined with -s, -M or -P\n");
+            return ERROR;
+        }
+        if (options.verbose && NULL != options.archive_path && STRINGS_EQUAL(options.archive_path, "-")) {
+            fprintf(stderr, "Verbose output cannot be used while writing the archive to stdout\n");
+            return ERROR;
+        }
+        return 1 == argc - optind ? NO_ERROR : ERROR;
+    }
+    if (2 != argc - optind || (options.hash && !options.sync)) {
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
+int main(int argc, char **argv) {
+    if (ERROR == parse_options(argc, argv)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    crc32c_init();
+    if (NULL != options.verify_path) {
+        return verify_tree(argv[optind]);
+    }
+    if (NULL != options.extract_path) {
+        return extract_tree(argv[optind]);
+    }
+
+    root_paths[SIDE_SRC] = argv[optind];
+    root_paths[SIDE_DEST] = NULL != options.archive_path ? options.archive_path : argv[optind + 1];
+    root_lengths[SIDE_SRC] = strlen(root_paths[SIDE_SRC]);
+    root_lengths[SIDE_DEST] = strlen(root_paths[SIDE_DEST]);
+
+    entry_t *root = calloc(1, sizeof(entry_t) + 1);
+    if (NULL == root) {
+        perror("main");
+        return EXIT_FAILURE;
+    }
+
+    if (NO_ERROR != fd_gate_init(FD_RESERVE + 3 * options.threads)) {
+        free(root);
+        return EXIT_FAILURE;
+    }
+
+    if (NO_ERROR != pool_init(&copy_pool, options.threads)) {
+        free(root);
+        return EXIT_FAILURE;
+    }
+    if (options.readers > 0 && NO_ERROR != pipeline_init(&pipeline, options.readers, options.writers)) {
+        pool_destroy(&copy_pool);
+        free(root);
+        return EXIT_FAILURE;
+    }
+    if (NULL != options.archive_path && NO_ERROR != archive_init(options.archive_path)) {
+        if (pipeline.readers > 0) {
+            pipeline_destroy(&pipeline);
+        }
+        pool_destroy(&copy_pool);
+        free(root);
+        return EXIT_FAILURE;
+    }
+    inode_map_init();
+
+    long long started = now_usec();
+    if (options.progress_interval > 0) {
+        progress_start(&started);
+    }
+    pool_submit(&copy_pool, copy_path, root);
+
+    pool_wait(&copy_pool);
+    if (options.schedule) {
+        schedule_submit();
+        pool_wait(&copy_pool);
+    }
+    int archived = NULL == options.archive_path ? NO_ERROR : archive_finish();
+    long long elapsed = now_usec() - started;
+    progress_stop();
+    int result = NULL == options.summary_path ? NO_ERROR : write_summary(options.summary_path, elapsed);
+    if (ERROR == archived) {
+        result = ERROR;
+    }
+    if (NULL != options.manifest_path && ERROR == write_manifest(options.manifest_path)) {
+        result = ERROR;
+    }
+    if (pipeline.readers > 0) {
+        pipeline_destroy(&pipeline);
+    }
+    stats_totals_t totals;
+    stats_collect(&totals);
+    pool_destroy(&copy_pool);
+    inode_map_destroy();
+    free(root);
+
+    if (options.verbose && atomic_load(&sparse_bytes_skipped) > 0) {
+        printf("Skipped %lld bytes of holes\n", (long long)atomic_load(&sparse_bytes_skipped));
+    }
+    return NO_ERROR == result && 0 == totals.errors ? EXIT_SUCCESS : EXIT_FAILURE;
 }
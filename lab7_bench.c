@@ -0,0 +1,646 @@
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE 700
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#define NO_ERROR 0
+#define ERROR -1
+#define MAX_MODES 32
+#define MAX_ARGS 64
+#define PATTERN_SIZE (1L << 20)
+#define PATTERN_SHIFT 512
+#define SAMPLE_MILLISECONDS 5
+#define NFTW_FDS 64
+#define USEC_PER_SEC 1000000LL
+#define BYTES_PER_MB (1024.0 * 1024.0)
+
+#define TINY_FILES 20000L
+#define TINY_FILES_PER_DIR 1000L
+#define TINY_MAX_SIZE 512
+#define DEEP_DEPTH 1000L
+#define DEEP_MAX_DEPTH 1500L
+#define WIDE_FILES 20000L
+#define WIDE_FILE_SIZE 128
+#define HUGE_FILES 4L
+#define HUGE_FILE_SIZE (256L << 20)
+#define SPARSE_FILES 4L
+#define SPARSE_FILE_SIZE (1L << 30)
+#define SPARSE_EXTENT_SIZE (1L << 20)
+#define SPARSE_STRIDE (64L << 20)
+#define LINK_FILES 1000L
+#define LINKS_PER_FILE 10L
+#define LINK_FILE_SIZE 4096
+
+#define STRINGS_EQUAL(STR1, STR2) (strcmp(STR1, STR2) == 0)
+
+typedef struct tree_stats {
+    long long files;
+    long long bytes;
+} tree_stats_t;
+
+typedef int (*generate_func_t)(const char *root, long scale, tree_stats_t *stats);
+
+typedef struct shape {
+    const char *name;
+    generate_func_t generate;
+} shape_t;
+
+typedef struct run_result {
+    double seconds;
+    long peak_rss_kb;
+    long peak_threads;
+    long peak_fds;
+    int status;
+} run_result_t;
+
+typedef struct bench_options {
+    const char *copier;
+    const char *workdir;
+    const char *output_path;
+    const char *shapes;
+    long scale;
+    long repeats;
+    const char *modes[MAX_MODES];
+    int mode_count;
+} bench_options_t;
+
+bench_options_t options;
+char *pattern = NULL;
+uint64_t pattern_seed = 0x9E3779B97F4A7C15ULL;
+const char *default_modes[] = { "", "-e read_write", "-u", "-S", "-D" };
+
+void print_error(const char *prefix, int code) {
+    char buf[256];
+    fprintf(stderr, "%s: %s\n", prefix, strerror_r(code, buf, sizeof(buf)));
+}
+
+long long now_usec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * USEC_PER_SEC + now.tv_nsec / 1000;
+}
+
+uint64_t next_random(void) {
+    pattern_seed ^= pattern_seed << 13;
+    pattern_seed ^= pattern_seed >> 7;
+    pattern_seed ^= pattern_seed << 17;
+    return pattern_seed;
+}
+
+int init_pattern(void) {
+    pattern = malloc(PATTERN_SIZE + PATTERN_SHIFT);
+    if (NULL == pattern) {
+        perror("init_pattern");
+        return ERROR;
+    }
+    for (long i = 0; i < PATTERN_SIZE + PATTERN_SHIFT; i += sizeof(uint64_t)) {
+        uint64_t value = next_random();
+        memcpy(pattern + i, &value, sizeof(value));
+    }
+    return NO_ERROR;
+}
+
+int write_data(int fd, off_t offset, off_t size) {
+    while (size > 0) {
+        size_t chunk = size > PATTERN_SIZE ? PATTERN_SIZE : (size_t)size;
+        ssize_t written = pwrite(fd, pattern + next_random() % PATTERN_SHIFT, chunk, offset);
+        if (ERROR == written) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return ERROR;
+        }
+        offset += written;
+        size -= written;
+    }
+    return NO_ERROR;
+}
+
+int create_file_at(int dirfd, const char *name, off_t size, tree_stats_t *stats) {
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (ERROR == fd) {
+        perror(name);
+        return ERROR;
+    }
+    int result = write_data(fd, 0, size);
+    if (ERROR == result) {
+        perror(name);
+    }
+    close(fd);
+    stats->files++;
+    stats->bytes += size;
+    return result;
+}
+
+int create_file(const char *path, off_t size, tree_stats_t *stats) {
+    return create_file_at(AT_FDCWD, path, size, stats);
+}
+
+int make_directory(const char *path) {
+    if (ERROR == mkdir(path, 0755) && EEXIST != errno) {
+        perror(path);
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
+int generate_tiny(const char *root, long scale, tree_stats_t *stats) {
+    char path[PATH_MAX];
+    long files = TINY_FILES * scale;
+    for (long i = 0; i < files; i++) {
+        if (0 == i % TINY_FILES_PER_DIR) {
+            snprintf(path, sizeof(path), "%s/d%ld", root, i / TINY_FILES_PER_DIR);
+            if (ERROR == make_directory(path)) {
+                return ERROR;
+            }
+        }
+        snprintf(path, sizeof(path), "%s/d%ld/f%ld", root, i / TINY_FILES_PER_DIR, i);
+        if (ERROR == create_file(path, (off_t)(next_random() % (TINY_MAX_SIZE + 1)), stats)) {
+            return ERROR;
+        }
+    }
+    return NO_ERROR;
+}
+
+int generate_deep(const char *root, long scale, tree_stats_t *stats) {
+    long depth = DEEP_DEPTH * scale > DEEP_MAX_DEPTH ? DEEP_MAX_DEPTH : DEEP_DEPTH * scale;
+    int dirfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ERROR == dirfd) {
+        perror(root);
+        return ERROR;
+    }
+    for (long i = 0; i < depth; i++) {
+        if (ERROR == create_file_at(dirfd, "f", TINY_MAX_SIZE, stats)) {
+            close(dirfd);
+            return ERROR;
+        }
+        if (ERROR == mkdirat(dirfd, "d", 0755)) {
+            perror(root);
+            close(dirfd);
+            return ERROR;
+        }
+        int next = openat(dirfd, "d", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(dirfd);
+        if (ERROR == next) {
+            perror(root);
+            return ERROR;
+        }
+        dirfd = next;
+    }
+    close(dirfd);
+    return NO_ERROR;
+}
+
+int generate_wide(const char *root, long scale, tree_stats_t *stats) {
+    char path[PATH_MAX];
+    long files = WIDE_FILES * scale;
+    for (long i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/f%ld", root, i);
+        if (ERROR == create_file(path, WIDE_FILE_SIZE, stats)) {
+            return ERROR;
+        }
+    }
+    return NO_ERROR;
+}
+
+int generate_huge(const char *root, long scale, tree_stats_t *stats) {
+    char path[PATH_MAX];
+    for (long i = 0; i < HUGE_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/f%ld", root, i);
+        if (ERROR == create_file(path, HUGE_FILE_SIZE * scale, stats)) {
+            return ERROR;
+        }
+    }
+    return NO_ERROR;
+}
+
+int generate_sparse(const char *root, long scale, tree_stats_t *stats) {
+    char path[PATH_MAX];
+    off_t size = SPARSE_FILE_SIZE * scale;
+    for (long i = 0; i < SPARSE_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/f%ld", root, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (ERROR == fd) {
+            perror(path);
+            return ERROR;
+        }
+        int result = ftruncate(fd, size);
+        for (off_t offset = 0; NO_ERROR == result && offset < size; offset += SPARSE_STRIDE) {
+            result = write_data(fd, offset, SPARSE_EXTENT_SIZE);
+            stats->bytes += SPARSE_EXTENT_SIZE;
+        }
+        if (ERROR == result) {
+            perror(path);
+        }
+        close(fd);
+        stats->files++;
+        if (ERROR == result) {
+            return ERROR;
+        }
+    }
+    return NO_ERROR;
+}
+
+int generate_links(const char *root, long scale, tree_stats_t *stats) {
+    char path[PATH_MAX];
+    char link_path[PATH_MAX];
+    long files = LINK_FILES * scale;
+    for (long i = 0; i < LINKS_PER_FILE; i++) {
+        snprintf(path, sizeof(path), "%s/l%ld", root, i);
+        if (ERROR == make_directory(path)) {
+            return ERROR;
+        }
+    }
+    for (long i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/l0/f%ld", root, i);
+        if (ERROR == create_file(path, LINK_FILE_SIZE, stats)) {
+            return ERROR;
+        }
+        for (long j = 1; j < LINKS_PER_FILE; j++) {
+            snprintf(link_path, sizeof(link_path), "%s/l%ld/f%ld", root, j, i);
+            if (ERROR == link(path, link_path)) {
+                perror(link_path);
+                return ERROR;
+            }
+            stats->files++;
+        }
+    }
+    return NO_ERROR;
+}
+
+const shape_t shapes[] = {
+    { "tiny", generate_tiny },
+    { "deep", generate_deep },
+    { "wide", generate_wide },
+    { "huge", generate_huge },
+    { "sparse", generate_sparse },
+    { "links", generate_links }
+};
+
+int remove_entry(const char *path, const struct stat *stat_buf, int type, struct FTW *ftw) {
+    (void)stat_buf;
+    (void)type;
+    (void)ftw;
+    if (ERROR == remove(path)) {
+        perror(path);
+    }
+    return NO_ERROR;
+}
+
+void remove_tree(const char *path) {
+    if (ERROR == access(path, F_OK)) {
+        return;
+    }
+    nftw(path, remove_entry, NFTW_FDS, FTW_DEPTH | FTW_PHYS);
+}
+
+int evict_entry(const char *path, const struct stat *stat_buf, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (FTW_F != type || !S_ISREG(stat_buf->st_mode)) {
+        return NO_ERROR;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (ERROR != fd) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    return NO_ERROR;
+}
+
+void drop_caches(const char *path) {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (ERROR != fd) {
+        int dropped = 1 == write(fd, "3", 1);
+        close(fd);
+        if (dropped) {
+            return;
+        }
+    }
+    nftw(path, evict_entry, NFTW_FDS, FTW_PHYS);
+}
+
+long read_thread_count(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (NULL == file) {
+        return 0;
+    }
+    char line[256];
+    long threads = 0;
+    while (NULL != fgets(line, sizeof(line), file)) {
+        if (1 == sscanf(line, "Threads: %ld", &threads)) {
+            break;
+        }
+    }
+    fclose(file);
+    return threads;
+}
+
+long read_fd_count(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+    DIR *dir = opendir(path);
+    if (NULL == dir) {
+        return 0;
+    }
+    long count = 0;
+    struct dirent *entry;
+    while (NULL != (entry = readdir(dir))) {
+        if ('.' != entry->d_name[0]) {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+int split_arguments(char *mode, char **argv, int max) {
+    int argc = 0;
+    for (char *token = strtok(mode, " "); NULL != token && argc < max; token = strtok(NULL, " ")) {
+        argv[argc++] = token;
+    }
+    return argc;
+}
+
+int run_copier(const char *mode, const char *src, const char *dest, run_result_t *result) {
+    char *mode_copy = strdup(mode);
+    if (NULL == mode_copy) {
+        perror("run_copier");
+        return ERROR;
+    }
+    char *argv[MAX_ARGS + 4];
+    int argc = 0;
+    argv[argc++] = (char *)options.copier;
+    argc += split_arguments(mode_copy, argv + argc, MAX_ARGS);
+    argv[argc++] = (char *)src;
+    argv[argc++] = (char *)dest;
+    argv[argc] = NULL;
+
+    memset(result, 0, sizeof(run_result_t));
+    long long started = now_usec();
+    pid_t pid = fork();
+    if (ERROR == pid) {
+        perror("fork");
+        free(mode_copy);
+        return ERROR;
+    }
+    if (0 == pid) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (ERROR != null_fd) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        execv(options.copier, argv);
+        perror(options.copier);
+        _exit(127);
+    }
+
+    // The pidfd becomes readable the moment the copier exits, so sampling
+    // between polls never delays the end of the measurement. The child is
+    // only reaped afterwards, which keeps its /proc entry ours while sampling.
+    int pid_fd = ERROR;
+#ifdef SYS_pidfd_open
+    pid_fd = (int)syscall(SYS_pidfd_open, pid, 0);
+#endif
+    if (ERROR == pid_fd) {
+        fprintf(stderr, "pidfd_open: %s, peak threads and fds are not sampled\n", strerror(errno));
+    }
+    while (ERROR != pid_fd) {
+        long threads = read_thread_count(pid);
+        long fds = read_fd_count(pid);
+        if (threads > result->peak_threads) {
+            result->peak_threads = threads;
+        }
+        if (fds > result->peak_fds) {
+            result->peak_fds = fds;
+        }
+        struct pollfd exited = { pid_fd, POLLIN, 0 };
+        int ready = poll(&exited, 1, SAMPLE_MILLISECONDS);
+        if (0 != ready && (ERROR != ready || EINTR != errno)) {
+            break;
+        }
+    }
+
+    struct rusage usage;
+    int status = 0;
+    pid_t done;
+    while (ERROR == (done = wait4(pid, &status, 0, &usage)) && EINTR == errno) {
+    }
+    long long finished = now_usec();
+    if (ERROR != pid_fd) {
+        close(pid_fd);
+    }
+    if (ERROR == done) {
+        perror("wait4");
+        free(mode_copy);
+        return ERROR;
+    }
+
+    result->seconds = (finished - started) / (double)USEC_PER_SEC;
+    result->peak_rss_kb = usage.ru_maxrss;
+    result->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    free(mode_copy);
+    return NO_ERROR;
+}
+
+void print_result(FILE *output, const char *shape, const char *mode, const char *cache, const tree_stats_t *stats, const run_result_t *result) {
+    double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+    fprintf(output, "%s,\"%s\",%s,%lld,%lld,%.6f,%.1f,%.2f,%ld,%ld,%ld,%d\n",
+            shape, '\0' == *mode ? "default" : mode, cache, stats->files, stats->bytes, result->seconds,
+            stats->files / seconds, stats->bytes / BYTES_PER_MB / seconds,
+            result->peak_rss_kb, result->peak_threads, result->peak_fds, result->status);
+    fflush(output);
+}
+
+int is_shape_selected(const char *name) {
+    if (NULL == options.shapes) {
+        return 1;
+    }
+    size_t length = strlen(name);
+    for (const char *start = options.shapes; NULL != start; ) {
+        const char *end = strchr(start, ',');
+        size_t token_length = NULL == end ? strlen(start) : (size_t)(end - start);
+        if (token_length == length && 0 == strncmp(start, name, length)) {
+            return 1;
+        }
+        start = NULL == end ? NULL : end + 1;
+    }
+    return 0;
+}
+
+int bench_shape(FILE *output, const shape_t *shape, const char *workdir) {
+    char src[PATH_MAX];
+    char dest[PATH_MAX];
+    snprintf(src, sizeof(src), "%s/%s", workdir, shape->name);
+    snprintf(dest, sizeof(dest), "%s/%s.copy", workdir, shape->name);
+    if (ERROR == make_directory(src)) {
+        return ERROR;
+    }
+
+    tree_stats_t stats = { 0, 0 };
+    fprintf(stderr, "Generating %s tree...\n", shape->name);
+    int result = shape->generate(src, options.scale, &stats);
+    for (int i = 0; NO_ERROR == result && i < options.mode_count; i++) {
+        for (long repeat = 0; repeat < options.repeats; repeat++) {
+            const char *caches[2] = { "cold", "warm" };
+            for (int cache = 0; cache < 2; cache++) {
+                if (0 == cache) {
+                    drop_caches(src);
+                }
+                run_result_t run;
+                if (ERROR == run_copier(options.modes[i], src, dest, &run)) {
+                    result = ERROR;
+                    break;
+                }
+                print_result(output, shape->name, options.modes[i], caches[cache], &stats, &run);
+                remove_tree(dest);
+            }
+        }
+    }
+    remove_tree(src);
+    return result;
+}
+
+long convert_number_from_string(char *string, long *out) {
+    if (NULL == string || NULL == out) {
+        fprintf(stderr, "convert_number_from_string : string or out was NULL\n");
+        return ERROR;
+    }
+
+    errno = 0;
+    char *endptr = "";
+    *out = strtol(string, &endptr, 10);
+
+    if (NO_ERROR != errno) {
+        perror("Can't convert given number");
+        return ERROR;
+    }
+    if (NO_ERROR != strcmp(endptr, "")) {
+        fprintf(stderr, "Number contains invalid symbols\n");
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-c copier] [-d workdir] [-s scale] [-r repeats] [-t shape,...] [-m \"copier options\"]... [-o results.csv]\n"
+                    "Shapes: tiny, deep, wide, huge, sparse, links\n", program);
+}
+
+int parse_options(int argc, char **argv) {
+    options.copier = "./lab7";
+    options.workdir = "/tmp";
+    options.scale = 1;
+    options.repeats = 1;
+
+    int option;
+    while (-1 != (option = getopt(argc, argv, "c:d:s:r:t:m:o:"))) {
+        switch (option) {
+            case 'c':
+                options.copier = optarg;
+                break;
+            case 'd':
+                options.workdir = optarg;
+                break;
+            case 's':
+                if (ERROR == convert_number_from_string(optarg, &options.scale) || options.scale < 1) {
+                    fprintf(stderr, "Scale must be positive number\n");
+                    return ERROR;
+                }
+                break;
+            case 'r':
+                if (ERROR == convert_number_from_string(optarg, &options.repeats) || options.repeats < 1) {
+                    fprintf(stderr, "Number of repeats must be positive number\n");
+                    return ERROR;
+                }
+                break;
+            case 't':
+                options.shapes = optarg;
+                break;
+            case 'm':
+                if (MAX_MODES == options.mode_count) {
+                    fprintf(stderr, "Too many modes\n");
+                    return ERROR;
+                }
+                options.modes[options.mode_count++] = optarg;
+                break;
+            case 'o':
+                options.output_path = optarg;
+                break;
+            default:
+                return ERROR;
+        }
+    }
+    if (optind != argc) {
+        return ERROR;
+    }
+    if (0 == options.mode_count) {
+        for (size_t i = 0; i < sizeof(default_modes) / sizeof(default_modes[0]); i++) {
+            options.modes[options.mode_count++] = default_modes[i];
+        }
+    }
+    return NO_ERROR;
+}
+
+int main(int argc, char **argv) {
+    if (ERROR == parse_options(argc, argv)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (ERROR == access(options.copier, X_OK)) {
+        perror(options.copier);
+        return EXIT_FAILURE;
+    }
+    if (ERROR == init_pattern()) {
+        return EXIT_FAILURE;
+    }
+
+    char workdir[PATH_MAX];
+    snprintf(workdir, sizeof(workdir), "%s/lab7_bench.XXXXXX", options.workdir);
+    if (NULL == mkdtemp(workdir)) {
+        perror(workdir);
+        free(pattern);
+        return EXIT_FAILURE;
+    }
+
+    FILE *output = stdout;
+    if (NULL != options.output_path && NULL == (output = fopen(options.output_path, "w"))) {
+        perror(options.output_path);
+        rmdir(workdir);
+        free(pattern);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(output, "shape,mode,cache,files,bytes,seconds,files_per_second,mb_per_second,peak_rss_kb,peak_threads,peak_fds,exit_status\n");
+    int result = NO_ERROR;
+    for (size_t i = 0; NO_ERROR == result && i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        if (is_shape_selected(shapes[i].name)) {
+            result = bench_shape(output, &shapes[i], workdir);
+        }
+    }
+
+    remove_tree(workdir);
+    if (stdout != output && ERROR == fclose(output)) {
+        perror(options.output_path);
+        result = ERROR;
+    }
+    free(pattern);
+    return NO_ERROR == result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
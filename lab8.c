@@ -1,18 +1,129 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <float.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-#define TOTAL_NUMBER_OF_STEPS 200000000
+#define DEFAULT_NUMBER_OF_STEPS 200000000
+#define MAX_NUMBER_OF_STEPS (1LL << 40)
+#define DEFAULT_PRECISION 1e-17
+#define CACHE_LINE_SIZE 64
+#define KERNEL_LANES 16
+#define LEIBNIZ_CHUNK_STEPS (1LL << 20)
+#define TERM_MAX_STEPS 1024
+#define PAIRWISE_LEAF_STEPS 1024
+#define SYSFS_CPU_PATH "/sys/devices/system/cpu"
 #define ERROR -1
 #define NO_ERROR 0
 
+#define STRINGS_EQUAL(STR1, STR2) (strcmp(STR1, STR2) == 0)
+
 typedef struct threadParameters {
-    long number_of_threads;
     long long index;
+    long long chunks;
+    int cpu;
+    int last_cpu;
+    long long busy_ns;
+    long long cpu_ns;
     double partial_sum;
-} threadParameters;
+} __attribute__((aligned(CACHE_LINE_SIZE))) threadParameters;
+
+typedef struct cpu_topology {
+    int cpu;
+    int package;
+    int core;
+    int core_rank;
+    int sibling_rank;
+} cpu_topology_t;
+
+typedef struct placement {
+    const char *name;
+    cpu_topology_t *cpus;
+    long count;
+    long physical_cores;
+} placement_t;
+
+typedef double (*series_kernel_t)(long long begin, long long end);
+
+typedef struct kernel {
+    const char *name;
+    series_kernel_t sum;
+    series_kernel_t compensated_sum;
+    const char *feature;
+} kernel_t;
+
+typedef double (*series_term_t)(long long step);
+typedef double (*series_bound_t)(long long steps);
+typedef double (*series_finish_t)(double sum);
+
+// A series for pi cut into steps. Steps are summed by one of the series'
+// kernels and the reduced sum is mapped to pi by finish. truncation_bound
+// bounds the error of stopping after a number of steps; rounding in the sum
+// comes on top of it. tail, when set, estimates the truncated remainder of pi.
+// terms_per_step is set only where a step is a fixed number of cheap terms,
+// so time per term means something; other series report time per step.
+typedef struct series {
+    const char *name;
+    const kernel_t *kernels;
+    size_t number_of_kernels;
+    series_term_t term;
+    series_finish_t finish;
+    series_bound_t truncation_bound;
+    series_bound_t tail;
+    long long default_steps;
+    long long max_steps;
+    long long chunk_steps;
+    int terms_per_step;
+} series_t;
+
+typedef double (*block_sum_t)(const kernel_t *kernel, long long begin, long long end);
+typedef double (*reduction_t)(const double *values, long count);
+
+typedef struct summation {
+    const char *name;
+    block_sum_t block_sum;
+    reduction_t reduce;
+} summation_t;
+
+typedef struct options {
+    long threads;
+    const char *series_name;
+    const char *kernel_name;
+    const char *summation_name;
+    const char *placement_name;
+    long steps;
+    long time_budget_ms;
+    double precision;
+} options_t;
+
+typedef struct schedule {
+    atomic_llong next_chunk;
+    long long number_of_chunks;
+    long long number_of_steps;
+    long time_budget_ms;
+    struct timespec deadline;
+    atomic_int timed_out;
+} schedule_t;
+
+options_t options;
+schedule_t schedule;
+placement_t placement;
+const series_t *series;
+atomic_int interrupted;
+const kernel_t *kernel;
+const summation_t *summation;
+double *block_sums;
 
 void print_error(const char *prefix, int code) {
     char buf[256];
@@ -22,6 +133,629 @@ void print_error(const char *prefix, int code) {
     fprintf(stderr, "%s: %s\n", prefix, buf);
 }
 
+double sum_sequential(const double *values, long count) {
+    double sum = 0.0;
+    for (long i = 0; i < count; i++) {
+        sum += values[i];
+    }
+    return sum;
+}
+
+double sum_neumaier(const double *values, long count) {
+    double sum = 0.0;
+    double compensation = 0.0;
+    for (long i = 0; i < count; i++) {
+        double total = sum + values[i];
+        if (fabs(sum) >= fabs(values[i])) {
+            compensation += (sum - total) + values[i];
+        } else {
+            compensation += (values[i] - total) + sum;
+        }
+        sum = total;
+    }
+    return sum + compensation;
+}
+
+double sum_pairwise(const double *values, long count) {
+    if (count <= 2) {
+        return 2 == count ? values[0] + values[1] : 1 == count ? values[0] : 0.0;
+    }
+    long half = count / 2;
+    return sum_pairwise(values, half) + sum_pairwise(values + half, count - half);
+}
+
+double sum_lanes_compensated(const double *sums, const double *compensations, long count) {
+    return sum_neumaier(sums, count) + sum_sequential(compensations, count);
+}
+
+// Every Leibniz kernel adds step begin + n to partial sum n % KERNEL_LANES
+// as the single term 2 / ((4i + 1)(4i + 3)), one correctly rounded division
+// per step, and reduces the lanes in the same fixed order. Vector kernels
+// only advance several lanes per instruction, so every kernel prints the
+// digits of the scalar one.
+void leibniz_lanes(double *sums, long long begin, long long end) {
+    for (long long i = begin; i < end; i += KERNEL_LANES) {
+        for (int lane = 0; lane < KERNEL_LANES && i + lane < end; lane++) {
+            double index = (double)(i + lane);
+            sums[lane] += 2.0 / ((index * 4.0 + 1.0) * (index * 4.0 + 3.0));
+        }
+    }
+}
+
+// The compensated lanes add the same terms with Knuth's branch-free
+// two-sum, which carries the same error as Neumaier's update.
+void leibniz_compensated_lanes(double *sums, double *compensations, long long begin, long long end) {
+    for (long long i = begin; i < end; i += KERNEL_LANES) {
+        for (int lane = 0; lane < KERNEL_LANES && i + lane < end; lane++) {
+            double index = (double)(i + lane);
+            double term = 2.0 / ((index * 4.0 + 1.0) * (index * 4.0 + 3.0));
+            double total = sums[lane] + term;
+            double rounded = total - sums[lane];
+            compensations[lane] += (sums[lane] - (total - rounded)) + (term - rounded);
+            sums[lane] = total;
+        }
+    }
+}
+
+double leibniz_scalar(long long begin, long long end) {
+    double sums[KERNEL_LANES] = { 0.0 };
+    leibniz_lanes(sums, begin, end);
+    return sum_pairwise(sums, KERNEL_LANES);
+}
+
+double leibniz_compensated_scalar(long long begin, long long end) {
+    double sums[KERNEL_LANES] = { 0.0 };
+    double compensations[KERNEL_LANES] = { 0.0 };
+    leibniz_compensated_lanes(sums, compensations, begin, end);
+    return sum_lanes_compensated(sums, compensations, KERNEL_LANES);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse2")))
+double leibniz_sse2(long long begin, long long end) {
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d two = _mm_set1_pd(2.0);
+    const __m128d three = _mm_set1_pd(3.0);
+    const __m128d four = _mm_set1_pd(4.0);
+    const __m128d stride = _mm_set1_pd((double)KERNEL_LANES);
+    __m128d sums[KERNEL_LANES / 2];
+    for (int k = 0; k < KERNEL_LANES / 2; k++) {
+        sums[k] = _mm_setzero_pd();
+    }
+    // Lane offsets are added to the block start rather than carried from lane
+    // to lane, so no add chain runs alongside the divisions
+    __m128d offsets[KERNEL_LANES / 2];
+    for (int k = 0; k < KERNEL_LANES / 2; k++) {
+        offsets[k] = _mm_add_pd(_mm_set1_pd(2.0 * k), _mm_set_pd(1, 0));
+    }
+    __m128d base = _mm_set1_pd((double)begin);
+
+    long long i = begin;
+    for (; i + KERNEL_LANES <= end; i += KERNEL_LANES) {
+        for (int k = 0; k < KERNEL_LANES / 2; k++) {
+            __m128d scaled = _mm_mul_pd(_mm_add_pd(base, offsets[k]), four);
+            __m128d product = _mm_mul_pd(_mm_add_pd(scaled, one), _mm_add_pd(scaled, three));
+            sums[k] = _mm_add_pd(sums[k], _mm_div_pd(two, product));
+        }
+        base = _mm_add_pd(base, stride);
+    }
+
+    double lanes[KERNEL_LANES];
+    for (int k = 0; k < KERNEL_LANES / 2; k++) {
+        _mm_storeu_pd(&lanes[2 * k], sums[k]);
+    }
+    leibniz_lanes(lanes, i, end);
+    return sum_pairwise(lanes, KERNEL_LANES);
+}
+
+__attribute__((target("sse2")))
+double leibniz_compensated_sse2(long long begin, long long end) {
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d two = _mm_set1_pd(2.0);
+    const __m128d three = _mm_set1_pd(3.0);
+    const __m128d four = _mm_set1_pd(4.0);
+    const __m128d stride = _mm_set1_pd((double)KERNEL_LANES);
+    __m128d sums[KERNEL_LANES / 2];
+    __m128d compensations[KERNEL_LANES / 2];
+    for (int k = 0; k < KERNEL_LANES / 2; k++) {
+        sums[k] = _mm_setzero_pd();
+        compensations[k] = _mm_setzero_pd();
+    }
+    __m128d offsets[KERNEL_LANES / 2];
+    for (int k = 0; k < KERNEL_LANES / 2; k++) {
+        offsets[k] = _mm_add_pd(_mm_set1_pd(2.0 * k), _mm_set_pd(1, 0));
+    }
+    __m128d base = _mm_set1_pd((double)begin);
+
+    long long i = begin;
+    for (; i + KERNEL_LANES <= end; i += KERNEL_LANES) {
+        for (int k = 0; k < KERNEL_LANES / 2; k++) {
+            __m128d scaled = _mm_mul_pd(_mm_add_pd(base, offsets[k]), four);
+            __m128d term = _mm_div_pd(two, _mm_mul_pd(_mm_add_pd(scaled, one), _mm_add_pd(scaled, three)));
+            __m128d total = _mm_add_pd(sums[k], term);
+            __m128d rounded = _mm_sub_pd(total, sums[k]);
+            __m128d error = _mm_add_pd(_mm_sub_pd(sums[k], _mm_sub_pd(total, rounded)), _mm_sub_pd(term, rounded));
+            compensations[k] = _mm_add_pd(compensations[k], error);
+            sums[k] = total;
+        }
+        base = _mm_add_pd(base, stride);
+    }
+
+    double lane_sums[KERNEL_LANES];
+    double lane_compensations[KERNEL_LANES];
+    for (int k = 0; k < KERNEL_LANES / 2; k++) {
+        _mm_storeu_pd(&lane_sums[2 * k], sums[k]);
+        _mm_storeu_pd(&lane_compensations[2 * k], compensations[k]);
+    }
+    leibniz_compensated_lanes(lane_sums, lane_compensations, i, end);
+    return sum_lanes_compensated(lane_sums, lane_compensations, KERNEL_LANES);
+}
+
+__attribute__((target("avx2")))
+double leibniz_avx2(long long begin, long long end) {
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d three = _mm256_set1_pd(3.0);
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256d stride = _mm256_set1_pd((double)KERNEL_LANES);
+    __m256d sums[KERNEL_LANES / 4];
+    for (int k = 0; k < KERNEL_LANES / 4; k++) {
+        sums[k] = _mm256_setzero_pd();
+    }
+    __m256d offsets[KERNEL_LANES / 4];
+    for (int k = 0; k < KERNEL_LANES / 4; k++) {
+        offsets[k] = _mm256_add_pd(_mm256_set1_pd(4.0 * k), _mm256_set_pd(3, 2, 1, 0));
+    }
+    __m256d base = _mm256_set1_pd((double)begin);
+
+    long long i = begin;
+    for (; i + KERNEL_LANES <= end; i += KERNEL_LANES) {
+        for (int k = 0; k < KERNEL_LANES / 4; k++) {
+            __m256d scaled = _mm256_mul_pd(_mm256_add_pd(base, offsets[k]), four);
+            __m256d product = _mm256_mul_pd(_mm256_add_pd(scaled, one), _mm256_add_pd(scaled, three));
+            sums[k] = _mm256_add_pd(sums[k], _mm256_div_pd(two, product));
+        }
+        base = _mm256_add_pd(base, stride);
+    }
+
+    double lanes[KERNEL_LANES];
+    for (int k = 0; k < KERNEL_LANES / 4; k++) {
+        _mm256_storeu_pd(&lanes[4 * k], sums[k]);
+    }
+    // The tail and the reduction are SSE code, which stalls on dirty upper halves
+    _mm256_zeroupper();
+    leibniz_lanes(lanes, i, end);
+    return sum_pairwise(lanes, KERNEL_LANES);
+}
+
+__attribute__((target("avx2")))
+double leibniz_compensated_avx2(long long begin, long long end) {
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d three = _mm256_set1_pd(3.0);
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256d stride = _mm256_set1_pd((double)KERNEL_LANES);
+    __m256d sums[KERNEL_LANES / 4];
+    __m256d compensations[KERNEL_LANES / 4];
+    for (int k = 0; k < KERNEL_LANES / 4; k++) {
+        sums[k] = _mm256_setzero_pd();
+        compensations[k] = _mm256_setzero_pd();
+    }
+    __m256d offsets[KERNEL_LANES / 4];
+    for (int k = 0; k < KERNEL_LANES / 4; k++) {
+        offsets[k] = _mm256_add_pd(_mm256_set1_pd(4.0 * k), _mm256_set_pd(3, 2, 1, 0));
+    }
+    __m256d base = _mm256_set1_pd((double)begin);
+
+    long long i = begin;
+    for (; i + KERNEL_LANES <= end; i += KERNEL_LANES) {
+        for (int k = 0; k < KERNEL_LANES / 4; k++) {
+            __m256d scaled = _mm256_mul_pd(_mm256_add_pd(base, offsets[k]), four);
+            __m256d term = _mm256_div_pd(two, _mm256_mul_pd(_mm256_add_pd(scaled, one), _mm256_add_pd(scaled, three)));
+            __m256d total = _mm256_add_pd(sums[k], term);
+            __m256d rounded = _mm256_sub_pd(total, sums[k]);
+            __m256d error = _mm256_add_pd(_mm256_sub_pd(sums[k], _mm256_sub_pd(total, rounded)), _mm256_sub_pd(term, rounded));
+            compensations[k] = _mm256_add_pd(compensations[k], error);
+            sums[k] = total;
+        }
+        base = _mm256_add_pd(base, stride);
+    }
+
+    double lane_sums[KERNEL_LANES];
+    double lane_compensations[KERNEL_LANES];
+    for (int k = 0; k < KERNEL_LANES / 4; k++) {
+        _mm256_storeu_pd(&lane_sums[4 * k], sums[k]);
+        _mm256_storeu_pd(&lane_compensations[4 * k], compensations[k]);
+    }
+    _mm256_zeroupper();
+    leibniz_compensated_lanes(lane_sums, lane_compensations, i, end);
+    return sum_lanes_compensated(lane_sums, lane_compensations, KERNEL_LANES);
+}
+
+__attribute__((target("avx512f")))
+double leibniz_avx512(long long begin, long long end) {
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d two = _mm512_set1_pd(2.0);
+    const __m512d three = _mm512_set1_pd(3.0);
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d stride = _mm512_set1_pd((double)KERNEL_LANES);
+    __m512d sums[KERNEL_LANES / 8];
+    for (int k = 0; k < KERNEL_LANES / 8; k++) {
+        sums[k] = _mm512_setzero_pd();
+    }
+    __m512d offsets[KERNEL_LANES / 8];
+    for (int k = 0; k < KERNEL_LANES / 8; k++) {
+        offsets[k] = _mm512_add_pd(_mm512_set1_pd(8.0 * k), _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0));
+    }
+    __m512d base = _mm512_set1_pd((double)begin);
+
+    long long i = begin;
+    for (; i + KERNEL_LANES <= end; i += KERNEL_LANES) {
+        for (int k = 0; k < KERNEL_LANES / 8; k++) {
+            __m512d scaled = _mm512_mul_pd(_mm512_add_pd(base, offsets[k]), four);
+            __m512d product = _mm512_mul_pd(_mm512_add_pd(scaled, one), _mm512_add_pd(scaled, three));
+            sums[k] = _mm512_add_pd(sums[k], _mm512_div_pd(two, product));
+        }
+        base = _mm512_add_pd(base, stride);
+    }
+
+    double lanes[KERNEL_LANES];
+    for (int k = 0; k < KERNEL_LANES / 8; k++) {
+        _mm512_storeu_pd(&lanes[8 * k], sums[k]);
+    }
+    // The tail and the reduction are SSE code, which stalls on dirty upper halves
+    _mm256_zeroupper();
+    leibniz_lanes(lanes, i, end);
+    return sum_pairwise(lanes, KERNEL_LANES);
+}
+
+__attribute__((target("avx512f")))
+double leibniz_compensated_avx512(long long begin, long long end) {
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d two = _mm512_set1_pd(2.0);
+    const __m512d three = _mm512_set1_pd(3.0);
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d stride = _mm512_set1_pd((double)KERNEL_LANES);
+    __m512d sums[KERNEL_LANES / 8];
+    __m512d compensations[KERNEL_LANES / 8];
+    for (int k = 0; k < KERNEL_LANES / 8; k++) {
+        sums[k] = _mm512_setzero_pd();
+        compensations[k] = _mm512_setzero_pd();
+    }
+    __m512d offsets[KERNEL_LANES / 8];
+    for (int k = 0; k < KERNEL_LANES / 8; k++) {
+        offsets[k] = _mm512_add_pd(_mm512_set1_pd(8.0 * k), _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0));
+    }
+    __m512d base = _mm512_set1_pd((double)begin);
+
+    long long i = begin;
+    for (; i + KERNEL_LANES <= end; i += KERNEL_LANES) {
+        for (int k = 0; k < KERNEL_LANES / 8; k++) {
+            __m512d scaled = _mm512_mul_pd(_mm512_add_pd(base, offsets[k]), four);
+            __m512d term = _mm512_div_pd(two, _mm512_mul_pd(_mm512_add_pd(scaled, one), _mm512_add_pd(scaled, three)));
+            __m512d total = _mm512_add_pd(sums[k], term);
+            __m512d rounded = _mm512_sub_pd(total, sums[k]);
+            __m512d error = _mm512_add_pd(_mm512_sub_pd(sums[k], _mm512_sub_pd(total, rounded)), _mm512_sub_pd(term, rounded));
+            compensations[k] = _mm512_add_pd(compensations[k], error);
+            sums[k] = total;
+        }
+        base = _mm512_add_pd(base, stride);
+    }
+
+    double lane_sums[KERNEL_LANES];
+    double lane_compensations[KERNEL_LANES];
+    for (int k = 0; k < KERNEL_LANES / 8; k++) {
+        _mm512_storeu_pd(&lane_sums[8 * k], sums[k]);
+        _mm512_storeu_pd(&lane_compensations[8 * k], compensations[k]);
+    }
+    _mm256_zeroupper();
+    leibniz_compensated_lanes(lane_sums, lane_compensations, i, end);
+    return sum_lanes_compensated(lane_sums, lane_compensations, KERNEL_LANES);
+}
+#endif
+
+const kernel_t leibniz_kernels[] = {
+#if defined(__x86_64__)
+    { "avx512", leibniz_avx512, leibniz_compensated_avx512, "avx512f" },
+    { "avx2", leibniz_avx2, leibniz_compensated_avx2, "avx2" },
+    { "sse2", leibniz_sse2, leibniz_compensated_sse2, "sse2" },
+#endif
+    { "scalar", leibniz_scalar, leibniz_compensated_scalar, NULL }
+};
+
+double term_sum(long long begin, long long end) {
+    double sum = 0.0;
+    for (long long k = begin; k < end; k++) {
+        sum += series->term(k);
+    }
+    return sum;
+}
+
+double term_compensated_sum(long long begin, long long end) {
+    double sum = 0.0;
+    double compensation = 0.0;
+    for (long long k = begin; k < end; k++) {
+        double term = series->term(k);
+        double total = sum + term;
+        if (fabs(sum) >= fabs(term)) {
+            compensation += (sum - total) + term;
+        } else {
+            compensation += (term - total) + sum;
+        }
+        sum = total;
+    }
+    return sum + compensation;
+}
+
+const kernel_t term_kernels[] = {
+    { "scalar", term_sum, term_compensated_sum, NULL }
+};
+
+double leibniz_finish(double sum) {
+    return sum * 4;
+}
+
+double leibniz_truncation_bound(long long steps) {
+    return 1.0 / steps;
+}
+
+// Two terms per step; the omitted tail is 1/terms up to an O(terms^-3) remainder
+double leibniz_tail(long long steps) {
+    return 1.0 / (2.0 * steps);
+}
+
+// pi = 16 arctan(1/5) - 4 arctan(1/239); step k holds the k-th term of both
+double machin_term(long long k) {
+    double denominator = 2.0 * k + 1.0;
+    double term = 16.0 / (denominator * pow(5.0, denominator)) - 4.0 / (denominator * pow(239.0, denominator));
+    return 0 == k % 2 ? term : -term;
+}
+
+double identity_finish(double sum) {
+    return sum;
+}
+
+// Both arctan series alternate with decreasing terms, so the remainder is below the next step
+double machin_truncation_bound(long long steps) {
+    return fabs(machin_term(steps));
+}
+
+double bbp_term(long long k) {
+    double eight_k = 8.0 * k;
+    return ldexp(4.0 / (eight_k + 1.0) - 2.0 / (eight_k + 4.0) - 1.0 / (eight_k + 5.0) - 1.0 / (eight_k + 6.0), -4 * (int)k);
+}
+
+// Terms are positive and shrink at least 16-fold per step
+double bbp_truncation_bound(long long steps) {
+    return bbp_term(steps) * 16.0 / 15.0;
+}
+
+// 1/pi = 12 / 640320^(3/2) * sum of (-1)^k (6k)! (13591409 + 545140134k) / ((3k)! (k!)^3 640320^(3k)).
+// The factorial ratio goes through lgamma so any step can be computed on its own;
+// its relative error only touches steps that are already below an ulp of the sum.
+double chudnovsky_term(long long k) {
+    double magnitude = exp(lgamma(6.0 * k + 1.0) - lgamma(3.0 * k + 1.0) - 3.0 * lgamma(k + 1.0) - 3.0 * k * log(640320.0));
+    double term = magnitude * (13591409.0 + 545140134.0 * k);
+    return 0 == k % 2 ? term : -term;
+}
+
+double chudnovsky_finish(double sum) {
+    return 640320.0 * sqrt(640320.0) / (12.0 * sum);
+}
+
+// The series alternates, so 1/pi is off by less than the next term scaled
+// by 12 / 640320^(3/2); that error is amplified by pi^2 in pi, doubled for slack.
+double chudnovsky_truncation_bound(long long steps) {
+    return 2.0 * M_PI * M_PI * 12.0 / (640320.0 * sqrt(640320.0)) * fabs(chudnovsky_term(steps));
+}
+
+const series_t all_series[] = {
+    { "leibniz", leibniz_kernels, sizeof(leibniz_kernels) / sizeof(leibniz_kernels[0]), NULL,
+      leibniz_finish, leibniz_truncation_bound, leibniz_tail, DEFAULT_NUMBER_OF_STEPS, MAX_NUMBER_OF_STEPS, LEIBNIZ_CHUNK_STEPS, 2 },
+    { "machin", term_kernels, 1, machin_term, identity_finish, machin_truncation_bound, NULL, 0, TERM_MAX_STEPS, 1, 0 },
+    { "bbp", term_kernels, 1, bbp_term, identity_finish, bbp_truncation_bound, NULL, 0, TERM_MAX_STEPS, 1, 0 },
+    { "chudnovsky", term_kernels, 1, chudnovsky_term, chudnovsky_finish, chudnovsky_truncation_bound, NULL, 0, TERM_MAX_STEPS, 1, 0 }
+};
+
+const series_t *select_series(const char *name) {
+    for (size_t i = 0; i < sizeof(all_series) / sizeof(all_series[0]); i++) {
+        if (STRINGS_EQUAL(name, all_series[i].name)) {
+            return &all_series[i];
+        }
+    }
+    return NULL;
+}
+
+int is_kernel_supported(const kernel_t *kernel) {
+#if defined(__x86_64__)
+    if (NULL != kernel->feature) {
+        __builtin_cpu_init();
+        return STRINGS_EQUAL(kernel->feature, "avx512f") ? __builtin_cpu_supports("avx512f")
+             : STRINGS_EQUAL(kernel->feature, "avx2") ? __builtin_cpu_supports("avx2")
+             : __builtin_cpu_supports("sse2");
+    }
+#endif
+    return NULL == kernel->feature;
+}
+
+double block_sum_naive(const kernel_t *kernel, long long begin, long long end) {
+    return kernel->sum(begin, end);
+}
+
+double block_sum_compensated(const kernel_t *kernel, long long begin, long long end) {
+    return kernel->compensated_sum(begin, end);
+}
+
+double block_sum_pairwise(const kernel_t *kernel, long long begin, long long end) {
+    long long half = (end - begin) / 2 / PAIRWISE_LEAF_STEPS * PAIRWISE_LEAF_STEPS;
+    if (0 == half) {
+        return kernel->sum(begin, end);
+    }
+    return block_sum_pairwise(kernel, begin, begin + half) + block_sum_pairwise(kernel, begin + half, end);
+}
+
+const summation_t summations[] = {
+    { "naive", block_sum_naive, sum_sequential },
+    { "kahan", block_sum_compensated, sum_neumaier },
+    { "pairwise", block_sum_pairwise, sum_pairwise }
+};
+
+const summation_t *select_summation(const char *name) {
+    for (size_t i = 0; i < sizeof(summations) / sizeof(summations[0]); i++) {
+        if (STRINGS_EQUAL(name, summations[i].name)) {
+            return &summations[i];
+        }
+    }
+    return NULL;
+}
+
+const kernel_t *select_kernel(const char *name) {
+    for (size_t i = 0; i < series->number_of_kernels; i++) {
+        const kernel_t *candidate = &series->kernels[i];
+        if ((NULL == name || STRINGS_EQUAL(name, candidate->name)) && is_kernel_supported(candidate)) {
+            return candidate;
+        }
+    }
+    return NULL;
+}
+
+void stop_on_interrupt(int signal_number) {
+    atomic_store(&interrupted, 1);
+    signal(signal_number, SIG_DFL);
+}
+
+int should_stop(void) {
+    if (atomic_load(&interrupted) || atomic_load(&schedule.timed_out)) {
+        return 1;
+    }
+    if (0 == schedule.time_budget_ms) {
+        return 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > schedule.deadline.tv_sec ||
+        (now.tv_sec == schedule.deadline.tv_sec && now.tv_nsec >= schedule.deadline.tv_nsec)) {
+        atomic_store(&schedule.timed_out, 1);
+        return 1;
+    }
+    return 0;
+}
+
+int read_topology_value(int cpu, const char *name, int fallback) {
+    char path[128];
+    snprintf(path, sizeof(path), SYSFS_CPU_PATH "/cpu%d/topology/%s", cpu, name);
+    FILE *file = fopen(path, "r");
+    if (NULL == file) {
+        return fallback;
+    }
+    int value = fallback;
+    if (1 != fscanf(file, "%d", &value)) {
+        value = fallback;
+    }
+    fclose(file);
+    return value;
+}
+
+int compare_compact(const void *first, const void *second) {
+    const cpu_topology_t *a = first, *b = second;
+    if (a->package != b->package) {
+        return a->package < b->package ? -1 : 1;
+    }
+    if (a->core != b->core) {
+        return a->core < b->core ? -1 : 1;
+    }
+    return a->cpu < b->cpu ? -1 : a->cpu > b->cpu;
+}
+
+// One hardware thread of every core before any sibling, alternating packages
+int compare_scatter(const void *first, const void *second) {
+    const cpu_topology_t *a = first, *b = second;
+    if (a->sibling_rank != b->sibling_rank) {
+        return a->sibling_rank < b->sibling_rank ? -1 : 1;
+    }
+    if (a->core_rank != b->core_rank) {
+        return a->core_rank < b->core_rank ? -1 : 1;
+    }
+    return a->package < b->package ? -1 : a->package > b->package;
+}
+
+// Collects the CPUs this process may run on, ranking cores within their
+// package and hardware threads within their core. Missing sysfs entries
+// make every CPU its own core.
+int load_topology(void) {
+    cpu_set_t allowed;
+    int errorCode = sched_getaffinity(0, sizeof(allowed), &allowed);
+    if (NO_ERROR != errorCode) {
+        perror("Unable to get CPU affinity");
+        return ERROR;
+    }
+
+    placement.cpus = calloc(CPU_COUNT(&allowed), sizeof(cpu_topology_t));
+    if (NULL == placement.cpus) {
+        perror("Unable to allocate CPU topology");
+        return ERROR;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpu_topology_t *entry = &placement.cpus[placement.count++];
+            entry->cpu = cpu;
+            entry->package = read_topology_value(cpu, "physical_package_id", 0);
+            entry->core = read_topology_value(cpu, "core_id", cpu);
+        }
+    }
+
+    qsort(placement.cpus, placement.count, sizeof(cpu_topology_t), compare_compact);
+    int core_rank = -1;
+    for (long i = 0; i < placement.count; i++) {
+        cpu_topology_t *entry = &placement.cpus[i];
+        cpu_topology_t *previous = 0 == i ? NULL : &placement.cpus[i - 1];
+        if (NULL == previous || previous->package != entry->package) {
+            core_rank = -1;
+        }
+        if (NULL != previous && previous->package == entry->package && previous->core == entry->core) {
+            entry->sibling_rank = previous->sibling_rank + 1;
+        } else {
+            core_rank++;
+            placement.physical_cores++;
+        }
+        entry->core_rank = core_rank;
+    }
+    return NO_ERROR;
+}
+
+// Orders placement.cpus for the policy and trims it to the usable CPUs
+int select_placement(const char *name) {
+    if (STRINGS_EQUAL(name, "compact")) {
+        return NO_ERROR;
+    }
+    if (STRINGS_EQUAL(name, "scatter") || STRINGS_EQUAL(name, "physical")) {
+        qsort(placement.cpus, placement.count, sizeof(cpu_topology_t), compare_scatter);
+        if (STRINGS_EQUAL(name, "physical")) {
+            placement.count = placement.physical_cores;
+        }
+        return NO_ERROR;
+    }
+    fprintf(stderr, "Unknown placement policy %s\n", name);
+    return ERROR;
+}
+
+void pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int errorCode = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (NO_ERROR != errorCode) {
+        print_error("Unable to pin thread", errorCode);
+    }
+}
+
+long long elapsed_ns_since(clockid_t clock, const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+}
+
 void *calculate_partial_sum(void *param) {
     if (NULL == param){
         fprintf(stderr, "calculate_partial_sum: invalid param\n");
@@ -33,17 +767,29 @@ void *calculate_partial_sum(void *param) {
         return data;
     }
 
-    double partial_sum = 0.0;
-    long long index = data->index;
-    long number_of_threads = data->number_of_threads;
+    // Pinning from inside the thread means no chunk is computed before it lands on its CPU
+    if (data->cpu >= 0) {
+        pin_thread(data->cpu);
+    }
+    struct timespec started, cpu_started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_started);
 
-    for (long long i = index; i <TOTAL_NUMBER_OF_STEPS; i+= number_of_threads) {
-        partial_sum += 1.0 / (i * 4.0 + 1.0);
-        partial_sum -= 1.0 / (i * 4.0 + 3.0);
+    while (!should_stop()) {
+        long long chunk = atomic_fetch_add(&schedule.next_chunk, 1);
+        if (chunk >= schedule.number_of_chunks) {
+            break;
+        }
+        long long end = (chunk + 1) * series->chunk_steps;
+        block_sums[chunk] = summation->block_sum(kernel, chunk * series->chunk_steps,
+                                                 end < schedule.number_of_steps ? end : schedule.number_of_steps);
+        data->partial_sum += block_sums[chunk];
+        data->chunks++;
     }
 
-    data->partial_sum = partial_sum;
-    printf("Thread %lld finished, partial sum %.16f\n", index, data->partial_sum);
+    data->busy_ns = elapsed_ns_since(CLOCK_MONOTONIC, &started);
+    data->cpu_ns = elapsed_ns_since(CLOCK_THREAD_CPUTIME_ID, &cpu_started);
+    data->last_cpu = sched_getcpu();
     return data;
 }
 
@@ -68,6 +814,27 @@ long convert_number_from_string(char *string, long *out) {
     return 0;
 }
 
+int convert_double_from_string(char *string, double *out) {
+    if (NULL == string || NULL == out) {
+        fprintf(stderr, "convert_double_from_string : string or out was NULL\n");
+        return ERROR;
+    }
+
+    errno = 0;
+    char *endptr = "";
+    *out = strtod(string, &endptr);
+
+    if (NO_ERROR != errno) {
+        perror("Can't convert given number");
+        return ERROR;
+    }
+    if (NO_ERROR != strcmp(endptr, "")) {
+        fprintf(stderr, "Number contains invalid symbols\n");
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
 long create_threads(pthread_t *threads, struct threadParameters *data, long number_of_threads) {
     if(number_of_threads < 1 || NULL == data || NULL == threads){
         fprintf(stderr, "create_threads: invalid parameters\n");
@@ -78,7 +845,9 @@ long create_threads(pthread_t *threads, struct threadParameters *data, long numb
 
     for (long i = 0; i < number_of_threads; i++) {
         data[i].index = i;
-        data[i].number_of_threads = number_of_threads;
+        data[i].chunks = 0;
+        data[i].partial_sum = 0.0;
+        data[i].cpu = NULL == placement.name ? -1 : placement.cpus[i % placement.count].cpu;
 
         errorCode = pthread_create(&threads[i], NULL, calculate_partial_sum, &data[i]);
         if (NO_ERROR != errorCode){
@@ -91,15 +860,16 @@ long create_threads(pthread_t *threads, struct threadParameters *data, long numb
     return num_of_created;
 }
 
-int join_threads(pthread_t *threads, long number_of_threads, double *pi) {
-    if(number_of_threads < 1 || NULL == pi || NULL == threads){
+int join_threads(pthread_t *threads, long number_of_threads, long long *completed_chunks, double *pi) {
+    if(number_of_threads < 1 || NULL == completed_chunks || NULL == pi || NULL == threads){
         fprintf(stderr, "join_threads: invalid parameters\n");
         return 0;
     }
 
     int errorCode;
     int return_value = 0;
-    double sum = 0.0;
+    long long fastest_ns = -1;
+    long long slowest_ns = 0;
 
     for (long i = 0; i < number_of_threads; i++) {
         struct threadParameters *res = NULL;
@@ -117,43 +887,258 @@ int join_threads(pthread_t *threads, long number_of_threads, double *pi) {
             continue;
         }
 
-        sum += res->partial_sum;
+        printf("Thread %lld on cpu %d%s: %lld chunks in %.1f ms (%.1f ms cpu), partial sum %.16f\n",
+               res->index, res->last_cpu, res->cpu >= 0 ? " (pinned)" : "", res->chunks,
+               res->busy_ns / 1e6, res->cpu_ns / 1e6, res->partial_sum);
+        if (fastest_ns < 0 || res->busy_ns < fastest_ns) {
+            fastest_ns = res->busy_ns;
+        }
+        if (res->busy_ns > slowest_ns) {
+            slowest_ns = res->busy_ns;
+        }
     }
-    (*pi) = sum * 4;
+    if (fastest_ns >= 0) {
+        printf("Slowest thread finished %.1f ms after the fastest\n", (slowest_ns - fastest_ns) / 1e6);
+    }
+
+    // Workers only stop between chunks, so every claimed chunk has been summed
+    // and the claimed ones always form a prefix of the series
+    long long claimed = atomic_load(&schedule.next_chunk);
+    (*completed_chunks) = claimed < schedule.number_of_chunks ? claimed : schedule.number_of_chunks;
+    // Chunks are reduced here in index order, so the result does not depend on the thread count
+    (*pi) = series->finish(summation->reduce(block_sums, *completed_chunks));
 
     return return_value;
 }
 
+void print_usage(const char *program) {
+    printf("Usage: %s [-s leibniz|machin|bbp|chudnovsky] [-k avx512|avx2|sse2|scalar]\n"
+           "          [-m naive|kahan|pairwise] [-n steps] [-t milliseconds] [-e precision]\n"
+           "          [-p none|compact|scatter|physical] threads_num|auto\n", program);
+}
+
+int parse_options(int argc, char **argv) {
+    int option;
+    long value;
+    options.series_name = "leibniz";
+    options.summation_name = "naive";
+    while (-1 != (option = getopt(argc, argv, "s:k:m:n:t:e:p:"))) {
+        switch (option) {
+            case 's':
+                options.series_name = optarg;
+                break;
+            case 'k':
+                options.kernel_name = optarg;
+                break;
+            case 'm':
+                options.summation_name = optarg;
+                break;
+            case 'n':
+                if (-1 == convert_number_from_string(optarg, &value)) {
+                    return ERROR;
+                }
+                if (value < 1) {
+                    fprintf(stderr, "Number of steps must be positive number\n");
+                    return ERROR;
+                }
+                options.steps = value;
+                break;
+            case 't':
+                if (-1 == convert_number_from_string(optarg, &options.time_budget_ms)) {
+                    return ERROR;
+                }
+                if (options.time_budget_ms < 1) {
+                    fprintf(stderr, "Time budget must be positive number\n");
+                    return ERROR;
+                }
+                break;
+            case 'e':
+                if (ERROR == convert_double_from_string(optarg, &options.precision)) {
+                    return ERROR;
+                }
+                if (!(options.precision > 0.0)) {
+                    fprintf(stderr, "Precision must be positive number\n");
+                    return ERROR;
+                }
+                break;
+            case 'p':
+                options.placement_name = optarg;
+                break;
+            default:
+                return ERROR;
+        }
+    }
+    if (1 != argc - optind) {
+        return ERROR;
+    }
+
+    if (STRINGS_EQUAL(argv[optind], "auto")) {
+        options.threads = 0;
+        return NO_ERROR;
+    }
+    if (-1 == convert_number_from_string(argv[optind], &options.threads)) {
+        return ERROR;
+    }
+    if (options.threads < 1) {
+        fprintf(stderr, "Number of threads must be positive number\n");
+        return ERROR;
+    }
+    return NO_ERROR;
+}
+
+// Error bounds only shrink with more steps, so the fewest steps meeting a
+// precision target are found by bisection and simply tighten the step budget.
+long long steps_for_precision(double precision) {
+    long long low = 1;
+    long long high = series->max_steps;
+    while (low < high) {
+        long long middle = low + (high - low) / 2;
+        if (series->truncation_bound(middle) <= precision) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+const char *stop_reason(long long completed_steps) {
+    if (atomic_load(&interrupted)) {
+        return "interrupt";
+    }
+    if (atomic_load(&schedule.timed_out)) {
+        return "time budget";
+    }
+    if (options.precision > 0.0 && completed_steps >= steps_for_precision(options.precision)) {
+        return "precision target";
+    }
+    return "step budget";
+}
+
 int main(int argc, char **argv) {
-    if (2 != argc) {
-        printf("Usage: %s threads_num\n", argv[0]);
-        return 0;
+    if (ERROR == parse_options(argc, argv)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
     }
 
-    long number_of_threads;
-    if (-1 == convert_number_from_string(argv[1], &number_of_threads)) {
+    series = select_series(options.series_name);
+    if (NULL == series) {
+        fprintf(stderr, "Unknown series %s\n", options.series_name);
+        print_usage(argv[0]);
         return EXIT_FAILURE;
     }
+    if (options.steps > series->max_steps) {
+        fprintf(stderr, "Number of steps for %s series must not exceed %lld\n", series->name, series->max_steps);
+        return EXIT_FAILURE;
+    }
+    kernel = select_kernel(options.kernel_name);
+    if (NULL == kernel) {
+        fprintf(stderr, "Kernel %s is not available for %s series on this CPU\n", options.kernel_name, series->name);
+        return EXIT_FAILURE;
+    }
+    summation = select_summation(options.summation_name);
+    if (NULL == summation) {
+        fprintf(stderr, "Unknown summation mode %s\n", options.summation_name);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    // The kernels are bound by the floating-point units, which SMT siblings
+    // share, so "auto" runs one thread per physical core and pins to them
+    if (0 == options.threads && NULL == options.placement_name) {
+        options.placement_name = "physical";
+    }
+    if (NULL != options.placement_name && !STRINGS_EQUAL(options.placement_name, "none")) {
+        placement.name = options.placement_name;
+    }
+    if (0 == options.threads || NULL != placement.name) {
+        if (ERROR == load_topology()) {
+            return EXIT_FAILURE;
+        }
+        if (NULL != placement.name && ERROR == select_placement(placement.name)) {
+            print_usage(argv[0]);
+            free(placement.cpus);
+            return EXIT_FAILURE;
+        }
+    }
+    long number_of_threads = 0 == options.threads ? placement.physical_cores : options.threads;
+    if (NULL != placement.name && number_of_threads > placement.count) {
+        fprintf(stderr, "%ld threads share %ld CPUs of the %s placement\n",
+                number_of_threads, placement.count, placement.name);
+    }
 
-    if (number_of_threads < 1) {
-        fprintf(stderr, "Number of threads must be positive number\n");
+    schedule.number_of_steps = 0 != series->default_steps ? series->default_steps : steps_for_precision(DEFAULT_PRECISION);
+    if (0 != options.steps) {
+        schedule.number_of_steps = options.steps;
+    } else if (0 != options.time_budget_ms || options.precision > 0.0) {
+        schedule.number_of_steps = series->max_steps;
+    }
+    if (options.precision > 0.0 && steps_for_precision(options.precision) < schedule.number_of_steps) {
+        schedule.number_of_steps = steps_for_precision(options.precision);
+    }
+    schedule.number_of_chunks = (schedule.number_of_steps + series->chunk_steps - 1) / series->chunk_steps;
+    schedule.time_budget_ms = options.time_budget_ms;
+
+    block_sums = calloc(schedule.number_of_chunks, sizeof(double));
+    if (NULL == block_sums) {
+        perror("Unable to allocate block sums");
+        free(placement.cpus);
         return EXIT_FAILURE;
     }
+    signal(SIGINT, stop_on_interrupt);
 
     pthread_t threads[number_of_threads];
     struct threadParameters data[number_of_threads];
 
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    schedule.deadline.tv_sec = start.tv_sec + schedule.time_budget_ms / 1000;
+    schedule.deadline.tv_nsec = start.tv_nsec + schedule.time_budget_ms % 1000 * 1000000;
+    if (schedule.deadline.tv_nsec >= 1000000000) {
+        schedule.deadline.tv_sec++;
+        schedule.deadline.tv_nsec -= 1000000000;
+    }
+
     long num_of_created = create_threads(threads, data, number_of_threads);
     if (num_of_created < number_of_threads) {
         fprintf(stderr, "Created %ld out of %ld threads!\n", num_of_created, number_of_threads);
     }
 
     double pi = 0.0;
-    if (0 != join_threads(threads, num_of_created, &pi)){
+    long long completed_chunks = 0;
+    if (0 == num_of_created || 0 != join_threads(threads, num_of_created, &completed_chunks, &pi)) {
         fprintf(stderr, "Couldn't calculate PI!\n");
         pthread_exit(NULL);
     }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    long long completed_steps = completed_chunks * series->chunk_steps;
+    if (completed_steps > schedule.number_of_steps) {
+        completed_steps = schedule.number_of_steps;
+    }
+    if (0 == completed_steps) {
+        fprintf(stderr, "Stopped (%s) before any steps were computed\n", stop_reason(completed_steps));
+        free(block_sums);
+        free(placement.cpus);
+        return EXIT_FAILURE;
+    }
 
-    printf("pi = %.16f\n", pi);
+    double elapsed_ns = (finish.tv_sec - start.tv_sec) * 1e9 + (finish.tv_nsec - start.tv_nsec);
+    printf("pi = %.16f (%s series, %s kernel, %s summation, %ld threads, %s placement)\n", pi, series->name,
+           kernel->name, summation->name, num_of_created, NULL == placement.name ? "no" : placement.name);
+    printf("%lld of %lld steps, stopped by %s, truncation bound %.3e\n",
+           completed_steps, schedule.number_of_steps, stop_reason(completed_steps), series->truncation_bound(completed_steps));
+    if (NULL != series->tail) {
+        printf("error vs M_PI = %+.3e, after tail correction %+.3e\n",
+               pi - M_PI, pi + series->tail(completed_steps) - M_PI);
+    } else {
+        printf("error vs M_PI = %+.3e\n", pi - M_PI);
+    }
+    if (0 != series->terms_per_step) {
+        printf("%.3f ms, %.3f ns/term\n", elapsed_ns / 1e6, elapsed_ns / ((double)series->terms_per_step * completed_steps));
+    } else {
+        printf("%.3f ms, %.3f ns/step\n", elapsed_ns / 1e6, elapsed_ns / completed_steps);
+    }
+    free(block_sums);
+    free(placement.cpus);
     return EXIT_SUCCESS;
 }